@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+# generates a c0 text assembly whose main() loops over a straight-line body
+# larger than the L1 cache, to measure the interpreter throughput:
+#
+#   python3 bench/large_function.py > large.s
+#   c0-vm-cpp -a large.s large.o
+#   c0-vm-cpp -r --stats large.o
+import sys
+
+body = int(sys.argv[1]) if len(sys.argv) > 1 else 16384
+loops = int(sys.argv[2]) if len(sys.argv) > 2 else 1000
+
+lines = [
+    ".constants:",
+    '0 S "main"',
+    ".start:",
+    ".functions:",
+    "0 0 0 1",
+    ".F0:",
+]
+ins = []
+ins += ["snew 1", "loada 0,0", "ipush 0", "istore"]
+head = len(ins)
+ins += ["loada 0,0", "iload", "ipush %d" % loops, "icmp", None]
+for i in range(body // 4):
+    ins += ["ipush %d" % i, "bipush 3", "imul", "pop"]
+ins += ["loada 0,0", "loada 0,0", "iload", "bipush 1", "iadd", "istore", "jmp %d" % head]
+ins[head + 4] = "jge %d" % len(ins)
+ins += ["bipush 0", "iret"]
+lines += ["%d %s" % (i, s) for i, s in enumerate(ins)]
+print("\n".join(lines))
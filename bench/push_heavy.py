@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+# generates a c0 text assembly whose main() loops over a body made of pushes,
+# to compare the per-push stack check with the guard page:
+#
+#   python3 bench/push_heavy.py > push.s
+#   c0-vm-cpp -a push.s push.o
+#   c0-vm-cpp -r --stats push.o
+#   c0-vm-cpp -r --stats --guard-page push.o
+import sys
+
+body = int(sys.argv[1]) if len(sys.argv) > 1 else 1024
+loops = int(sys.argv[2]) if len(sys.argv) > 2 else 20000
+
+lines = [
+    ".constants:",
+    '0 S "main"',
+    ".start:",
+    ".functions:",
+    "0 0 0 1",
+    ".F0:",
+]
+ins = []
+ins += ["snew 1", "loada 0,0", "ipush 0", "istore"]
+head = len(ins)
+ins += ["loada 0,0", "iload", "ipush %d" % loops, "icmp", None]
+for i in range(body // 6):
+    ins += ["ipush %d" % i, "dup", "iadd", "loada 0,0", "dup2", "popn 4"]
+ins += ["loada 0,0", "loada 0,0", "iload", "bipush 1", "iadd", "istore", "jmp %d" % head]
+ins[head + 4] = "jge %d" % len(ins)
+ins += ["bipush 0", "iret"]
+lines += ["%d %s" % (i, s) for i, s in enumerate(ins)]
+print("\n".join(lines))
@@ -0,0 +1,246 @@
+#include "./batch.h"
+#include "./vm.h"
+#include "./file.h"
+#include "./exception.h"
+#include "./io.h"
+#include "./scheduler.h"
+#include "./util/mapped_file.hpp"
+#include "./util/json.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+struct BatchResult {
+    std::string status;
+    std::string error;
+    vm::u8 instructions = 0;
+    double seconds = 0;
+};
+
+std::string readText(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::in);
+    if (!in) {
+        throw InvalidFile("cannot open " + path);
+    }
+    return std::string(std::istreambuf_iterator<char>(in), {});
+}
+
+// the content of a file, mapped when possible, otherwise read into text
+std::string_view fileContent(const std::string& path, std::optional<MappedFile>& mapping, std::string& text) {
+    mapping.emplace(path);
+    if (!mapping->opened()) {
+        throw InvalidFile("cannot open " + path);
+    }
+    if (mapping->mapped()) {
+        return std::string_view(reinterpret_cast<const char*>(mapping->data()), mapping->size());
+    }
+    text = readText(path);
+    return text;
+}
+
+// the status of a run that reached its end, by its output
+void judge(BatchResult& result, const BatchCase& c, const std::string& output) {
+    if (c.expected.empty()) {
+        result.status = "done";
+        return;
+    }
+    std::optional<MappedFile> expectedMapping;
+    std::string expectedText;
+    auto expected = fileContent(c.expected, expectedMapping, expectedText);
+    result.status = output == expected ? "pass" : "fail";
+}
+
+}
+
+std::vector<BatchCase> read_manifest(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw InvalidFile("cannot open manifest " + path);
+    }
+    auto slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    const auto resolve = [&](const std::string& p) {
+        if (p.empty() || p == "-") {
+            return std::string();
+        }
+        return p[0] == '/' ? p : dir + p;
+    };
+
+    std::vector<BatchCase> cases;
+    std::string line;
+    for (int lineCount = 1; std::getline(in, line); ++lineCount) {
+        std::istringstream fields(line);
+        std::string binary, input, expected, extra;
+        if (!(fields >> binary) || binary[0] == '#') {
+            continue;
+        }
+        fields >> input >> expected;
+        if (fields >> extra) {
+            throw InvalidFile("manifest line " + std::to_string(lineCount) + ": too many fields");
+        }
+        cases.push_back(BatchCase{resolve(binary), resolve(input), resolve(expected)});
+    }
+    return cases;
+}
+
+std::size_t run_batch(const std::vector<BatchCase>& cases, std::ostream& out, unsigned threads, bool interleave,
+                      const vm::VM::Limits& limits) {
+    // every binary is loaded once and shared by all workers, a broken one fails all its cases
+    std::unordered_map<std::string, std::size_t> binaryIndex;
+    std::vector<std::string> binaries;
+    for (auto& c : cases) {
+        if (binaryIndex.emplace(c.binary, binaries.size()).second) {
+            binaries.push_back(c.binary);
+        }
+    }
+    std::vector<std::shared_ptr<const vm::Program>> programs(binaries.size());
+    std::vector<std::string> loadErrors(binaries.size());
+    parallel_for(binaries.size(), [&](std::size_t i) {
+        try {
+            programs[i] = std::make_shared<const vm::Program>(File::parse_file_binary(binaries[i]));
+        }
+        catch (const std::exception& e) {
+            loadErrors[i] = e.what();
+        }
+    }, threads);
+
+    // every worker runs all its cases on one VM, switching the program when the binary changes
+    struct Worker {
+        std::unique_ptr<vm::VM> vm;
+        std::size_t binary;
+        std::ostringstream err;
+    };
+    std::vector<Worker> workers(std::max(threads, 1u));
+    std::vector<BatchResult> results(cases.size());
+    const auto runCase = [&](std::size_t i, unsigned w) {
+        auto& c = cases[i];
+        auto& result = results[i];
+        auto index = binaryIndex.at(c.binary);
+        if (programs[index] == nullptr) {
+            result.status = "error";
+            result.error = loadErrors[index];
+            return;
+        }
+        try {
+            std::optional<MappedFile> inputMapping;
+            std::string inputText;
+            vm::SpanInput in(c.input.empty() ? std::string_view() : fileContent(c.input, inputMapping, inputText));
+            vm::BufferOutput output;
+            auto& worker = workers[w];
+            worker.err.str(std::string());
+            if (worker.vm == nullptr) {
+                worker.vm = vm::VM::make_vm(programs[index], output, in, worker.err);
+            }
+            else {
+                if (worker.binary != index) {
+                    worker.vm->load(programs[index]);
+                }
+                worker.vm->attach(output, in, worker.err);
+            }
+            worker.binary = index;
+            auto& avm = worker.vm;
+            avm->setLimits(limits);
+            auto begin = std::chrono::steady_clock::now();
+            avm->start();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+            result.seconds = elapsed.count();
+            result.instructions = avm->executedInstructions();
+            if (!avm->error().empty()) {
+                result.status = avm->limitExceeded() ? "limit" : "error";
+                result.error = avm->error();
+            }
+            else {
+                judge(result, c, output.str());
+            }
+        }
+        catch (const std::exception& e) {
+            result.status = "error";
+            result.error = e.what();
+        }
+    };
+
+    if (interleave) {
+        // every thread interleaves its share of the cases, so it is not held up by an input
+        // that is not there yet, e.g. a pipe some other process feeds
+        auto schedulers = std::max(std::min<std::size_t>(threads, cases.size()), std::size_t(1));
+        parallel_for(schedulers, [&](std::size_t t) {
+            vm::Scheduler scheduler;
+            scheduler.setLimits(limits);
+            auto begin = std::chrono::steady_clock::now();
+            for (std::size_t i = t; i < cases.size(); i += schedulers) {
+                auto& c = cases[i];
+                auto& result = results[i];
+                auto index = binaryIndex.at(c.binary);
+                if (programs[index] == nullptr) {
+                    result.status = "error";
+                    result.error = loadErrors[index];
+                    continue;
+                }
+                int fd = -1;
+                if (!c.input.empty() && (fd = ::open(c.input.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+                    result.status = "error";
+                    result.error = "cannot open " + c.input;
+                    continue;
+                }
+                scheduler.add(programs[index], fd, -1, [&, fd, begin](vm::Scheduler::Finished& finished) {
+                    if (fd >= 0) {
+                        ::close(fd);
+                    }
+                    // the runs share the thread, this is the time until the run finished
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+                    result.seconds = elapsed.count();
+                    result.instructions = finished.instructions;
+                    if (!finished.error.empty()) {
+                        result.status = finished.limitExceeded ? "limit" : "error";
+                        result.error = finished.error;
+                        return;
+                    }
+                    try {
+                        judge(result, c, finished.output);
+                    }
+                    catch (const std::exception& e) {
+                        result.status = "error";
+                        result.error = e.what();
+                    }
+                });
+            }
+            scheduler.run();
+        }, static_cast<unsigned>(schedulers));
+    }
+    else {
+        parallel_for_workers(cases.size(), runCase, threads);
+    }
+
+    std::size_t failed = 0;
+    for (std::size_t i = 0; i < cases.size(); ++i) {
+        auto& c = cases[i];
+        auto& result = results[i];
+        out << "{\"case\":" << i << ",\"binary\":";
+        printJsonString(out, c.binary);
+        out << ",\"input\":";
+        printJsonString(out, c.input);
+        out << ",\"status\":\"" << result.status << "\",\"instructions\":" << result.instructions
+            << ",\"seconds\":" << result.seconds;
+        if (!result.error.empty()) {
+            out << ",\"error\":";
+            printJsonString(out, result.error);
+        }
+        out << "}\n";
+        if (result.status == "fail" || result.status == "error" || result.status == "limit") {
+            ++failed;
+        }
+    }
+    out.flush();
+    return failed;
+}
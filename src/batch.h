@@ -0,0 +1,35 @@
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+
+#include "./vm.h"
+#include "./util/parallel.hpp"
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// one run of a binary, empty input and expected mean none
+struct BatchCase {
+    std::string binary;
+    std::string input;
+    std::string expected;
+};
+
+// a manifest line is "binary [input [expected]]" with "-" for none,
+// lines starting with # are comments,
+// relative paths are taken from the directory of the manifest
+std::vector<BatchCase> read_manifest(const std::string& path);
+
+// decodes every binary once and spreads the cases over threads,
+// each case runs in its own VM reading the mapped input and writing to memory.
+// writes one JSON object per case to out, in manifest order,
+// and returns the number of cases that did not pass.
+// interleave: every thread takes turns between its cases instead of running them one by one,
+// for inputs that arrive while the runs go on.
+// a case stopped by the limits has the status "limit"
+std::size_t run_batch(const std::vector<BatchCase>& cases, std::ostream& out,
+                      unsigned threads = default_thread_count(), bool interleave = false,
+                      const vm::VM::Limits& limits = vm::VM::Limits());
+
+#endif
@@ -0,0 +1,357 @@
+#include "./cache.h"
+#include "./exception.h"
+#include "./util/mapped_file.hpp"
+#include "./util/hash.hpp"
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'C', '0', 'V', 'M', 'C', 'A', 'C', 'H'};
+// bump whenever the decoder or the layout of an entry changes
+const vm::u4 CACHE_FORMAT = 4;
+
+// identifies the running executable, so that entries of any other build are stale
+// whichever of its sources changed: a rebuild links a new file, with a new inode or time.
+// 0 when it cannot be read, the cache is not used then
+vm::u8 buildId() {
+    static const vm::u8 id = [] {
+        struct stat st;
+        if (::stat("/proc/self/exe", &st) != 0) {
+            return vm::u8(0);
+        }
+        vm::u8 key[] = {
+            static_cast<vm::u8>(st.st_dev), static_cast<vm::u8>(st.st_ino), static_cast<vm::u8>(st.st_size),
+            static_cast<vm::u8>(st.st_mtim.tv_sec), static_cast<vm::u8>(st.st_mtim.tv_nsec),
+        };
+        return vm::u8(hash_bytes(key, sizeof key) | 1);
+    }();
+    return id;
+}
+
+struct CacheHeader {
+    char magic[8];
+    vm::u4 format;
+    vm::u4 slotSize;
+    vm::u8 buildId;
+    vm::u8 inputHash;
+    vm::u8 inputSize;
+    vm::u8 payloadSize;
+    vm::u8 payloadChecksum;
+};
+
+template <typename T>
+void put(std::string& out, const T& v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof v);
+}
+
+template <typename T>
+void putVector(std::string& out, const std::vector<T>& v) {
+    put<vm::u4>(out, v.size());
+    out.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+// the bytes of the operand of a packed instruction in an entry: its own size,
+// none for loada whose x is the next index into the wide operands
+vm::u1 operandSize(vm::OpCode op) {
+    return op == vm::OpCode::loada ? 0 : vm::infoOf(op).paramSizes[0];
+}
+
+// the execution encoding, without the padding of its 8 bytes per instruction
+// and the operands in their own sizes, turned back into it by a single pass.
+// false if an operand does not fit, the program is not cached then
+bool putCode(std::string& out, const vm::Program::Code& code) {
+    put<vm::u4>(out, code.code.size());
+    vm::u4 wide = 0;
+    for (auto& ins : code.code) {
+        auto size = operandSize(ins.op);
+        if (ins.op == vm::OpCode::loada ? ins.x != wide++ : size < sizeof ins.x && (ins.x >> (8 * size)) != 0) {
+            return false;
+        }
+        out.push_back(static_cast<char>(ins.op));
+        for (vm::u1 b = 0; b < size; ++b) {
+            out.push_back(static_cast<char>(ins.x >> (8 * b)));
+        }
+    }
+    put<vm::u4>(out, code.wideOperands.size());
+    for (auto& [level, offset] : code.wideOperands) {
+        put(out, level);
+        put(out, offset);
+    }
+    return true;
+}
+
+// bounds checked reader of a payload
+class Reader {
+public:
+    Reader(const unsigned char* p, const unsigned char* end) : _p(p), _end(end) {}
+    template <typename T>
+    bool get(T& v) {
+        return bytes(&v, sizeof v);
+    }
+    bool bytes(void* dst, std::size_t size) {
+        if (static_cast<std::size_t>(_end - _p) < size) {
+            return false;
+        }
+        std::memcpy(dst, _p, size);
+        _p += size;
+        return true;
+    }
+    template <typename T>
+    bool vector(std::vector<T>& v) {
+        vm::u4 count;
+        if (!get(count) || static_cast<std::size_t>(_end - _p) / sizeof(T) < count) {
+            return false;
+        }
+        v.resize(count);
+        return bytes(v.data(), count * sizeof(T));
+    }
+    bool code(vm::Program::Code& c) {
+        vm::u4 count;
+        if (!get(count) || static_cast<std::size_t>(_end - _p) < count) {
+            return false;
+        }
+        c.code.resize(count);
+        vm::u4 wide = 0;
+        for (auto& ins : c.code) {
+            if (_p == _end || !vm::isOpCode(*_p)) {
+                return false;
+            }
+            ins.op = static_cast<vm::OpCode>(*_p++);
+            ins.x = 0;
+            if (ins.op == vm::OpCode::loada) {
+                ins.x = wide++;
+            }
+            else {
+                auto size = operandSize(ins.op);
+                if (static_cast<std::size_t>(_end - _p) < size) {
+                    return false;
+                }
+                for (vm::u1 b = 0; b < size; ++b) {
+                    ins.x |= static_cast<vm::u4>(*_p++) << (8 * b);
+                }
+            }
+        }
+        vm::u4 wideCount;
+        if (!get(wideCount) || wideCount != wide) {
+            return false;
+        }
+        c.wideOperands.resize(wideCount);
+        for (auto& [level, offset] : c.wideOperands) {
+            if (!get(level) || !get(offset)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool atEnd() const { return _p == _end; }
+
+private:
+    const unsigned char* _p;
+    const unsigned char* _end;
+};
+
+}
+
+ProgramCache::ProgramCache(std::string dir) : _dir(std::move(dir)), _hit(false) {
+    ::mkdir(_dir.c_str(), 0755);
+}
+
+std::string ProgramCache::entryPath(vm::u8 inputHash) const {
+    char name[32];
+    std::snprintf(name, sizeof name, "%016llx.c0c", static_cast<unsigned long long>(inputHash));
+    return _dir + "/" + name;
+}
+
+std::shared_ptr<const vm::Program> ProgramCache::load(const std::string& path) {
+    MappedFile input(path);
+    if (!input.opened()) {
+        throw InvalidFile("cannot open input file");
+    }
+    _hit = false;
+    if (!input.mapped()) {
+        // not a regular file, nothing to key the cache with
+        return std::make_shared<const vm::Program>(File::parse_file_binary(path));
+    }
+    if (buildId() == 0) {
+        return std::make_shared<const vm::Program>(File::parse_binary(input.data(), input.size()));
+    }
+    auto inputHash = hash_bytes(input.data(), input.size());
+    auto entry = entryPath(inputHash);
+    if (auto program = read(entry, inputHash, input.data(), input.size())) {
+        _hit = true;
+        return program;
+    }
+    auto program = std::make_shared<const vm::Program>(File::parse_binary(input.data(), input.size()));
+    write(entry, inputHash, input.data(), input.size(), *program);
+    return program;
+}
+
+std::shared_ptr<const vm::Program> ProgramCache::read(const std::string& entry, vm::u8 inputHash,
+                                                      const vm::u1* input, std::size_t inputSize) const {
+    MappedFile cached(entry);
+    if (!cached.mapped() || cached.size() < sizeof(CacheHeader)) {
+        return nullptr;
+    }
+    CacheHeader header;
+    std::memcpy(&header, cached.data(), sizeof header);
+    if (std::memcmp(header.magic, CACHE_MAGIC, sizeof CACHE_MAGIC) != 0
+        || header.format != CACHE_FORMAT
+        || header.slotSize != sizeof(vm::slot_t)
+        || header.buildId != buildId()
+        || header.inputHash != inputHash
+        || header.inputSize != inputSize
+        || header.inputSize > cached.size() - sizeof header
+        || header.payloadSize != cached.size() - sizeof header - header.inputSize) {
+        return nullptr;
+    }
+    // the hash only names the entry, a crafted input could share it
+    if (std::memcmp(cached.data() + sizeof header, input, inputSize) != 0) {
+        return nullptr;
+    }
+    auto payload = cached.data() + sizeof header + header.inputSize;
+    if (header.payloadChecksum != hash_bytes(payload, header.payloadSize)) {
+        return nullptr;
+    }
+
+    Reader in(payload, payload + header.payloadSize);
+    vm::u4 constantsCount, functionsCount;
+    if (!in.get(constantsCount) || !in.get(functionsCount)) {
+        return nullptr;
+    }
+    std::vector<vm::Constant> constants(constantsCount);
+    for (auto& constant : constants) {
+        if (!in.get(constant.type)) {
+            return nullptr;
+        }
+        switch (constant.type) {
+        case vm::Constant::Type::STRING: {
+            vm::u4 length;
+            std::string s;
+            if (!in.get(length) || length > UINT16_MAX) {
+                return nullptr;
+            }
+            s.resize(length);
+            if (!in.bytes(s.data(), length)) {
+                return nullptr;
+            }
+            constant.value = std::move(s);
+        } break;
+        case vm::Constant::Type::INT: {
+            vm::int_t v;
+            if (!in.get(v)) {
+                return nullptr;
+            }
+            constant.value = v;
+        } break;
+        case vm::Constant::Type::DOUBLE: {
+            vm::double_t v;
+            if (!in.get(v)) {
+                return nullptr;
+            }
+            constant.value = v;
+        } break;
+        default:
+            return nullptr;
+        }
+    }
+    std::vector<vm::Function> functions(functionsCount);
+    for (auto& fun : functions) {
+        if (!in.get(fun.nameIndex) || !in.get(fun.paramSize) || !in.get(fun.level)) {
+            return nullptr;
+        }
+    }
+    std::vector<vm::Program::Code> code(functionsCount + std::size_t(1));
+    for (auto& c : code) {
+        if (!in.code(c)) {
+            return nullptr;
+        }
+    }
+    vm::u1 hasData;
+    std::optional<vm::DataSection> data;
+    if (!in.get(hasData)) {
+        return nullptr;
+    }
+    if (hasData) {
+        data.emplace();
+        if (!in.vector(data->stack) || !in.vector(data->heapRecord) || !in.vector(data->heap)) {
+            return nullptr;
+        }
+    }
+    if (!in.atEnd()) {
+        return nullptr;
+    }
+    File file{data ? 2u : 1u, std::move(constants), {}, std::move(functions)};
+    file.data = std::move(data);
+    return std::make_shared<const vm::Program>(std::move(file), std::move(code));
+}
+
+void ProgramCache::write(const std::string& entry, vm::u8 inputHash, const vm::u1* input, std::size_t inputSize,
+                         const vm::Program& program) const {
+    std::string payload;
+    put<vm::u4>(payload, program.constants().size());
+    put<vm::u4>(payload, program.functions().size());
+    for (auto& constant : program.constants()) {
+        put(payload, constant.type);
+        switch (constant.type) {
+        case vm::Constant::Type::STRING: {
+            auto& s = std::get<vm::str_t>(constant.value);
+            put<vm::u4>(payload, s.size());
+            payload += s;
+        } break;
+        case vm::Constant::Type::INT:    put(payload, std::get<vm::int_t>(constant.value));    break;
+        case vm::Constant::Type::DOUBLE: put(payload, std::get<vm::double_t>(constant.value)); break;
+        }
+    }
+    for (auto& fun : program.functions()) {
+        put(payload, fun.nameIndex);
+        put(payload, fun.paramSize);
+        put(payload, fun.level);
+    }
+    for (int i = -1; i < static_cast<int>(program.functions().size()); ++i) {
+        if (!putCode(payload, program.code(i))) {
+            return;
+        }
+    }
+    auto& data = program.data();
+    put<vm::u1>(payload, data ? 1 : 0);
+    if (data) {
+        putVector(payload, data->stack);
+        putVector(payload, data->heapRecord);
+        putVector(payload, data->heap);
+    }
+
+    CacheHeader header;
+    std::memset(&header, 0, sizeof header);
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+    header.format = CACHE_FORMAT;
+    header.slotSize = sizeof(vm::slot_t);
+    header.buildId = buildId();
+    header.inputHash = inputHash;
+    header.inputSize = inputSize;
+    header.payloadSize = payload.size();
+    header.payloadChecksum = hash_bytes(payload.data(), payload.size());
+
+    // concurrent runs may write the same entry, only a complete one is renamed into place
+    auto temp = entry + ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::out | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof header);
+        out.write(reinterpret_cast<const char*>(input), inputSize);
+        out.write(payload.data(), payload.size());
+        if (!out) {
+            out.close();
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+    if (std::rename(temp.c_str(), entry.c_str()) != 0) {
+        std::remove(temp.c_str());
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#include "./type.h"
+#include "./program.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// on-disk cache of loaded binaries: the packed code the VM executes, so that a hit
+// neither decodes nor packs. an entry is named by the hash of the input bytes and keeps
+// a copy of them to compare, it is tied to the executable of the VM,
+// stale or corrupt entries are ignored and rebuilt.
+class ProgramCache {
+public:
+    explicit ProgramCache(std::string dir);
+
+    // loads the binary file at path, through the cache
+    std::shared_ptr<const vm::Program> load(const std::string& path);
+
+    bool hit() const { return _hit; }
+
+private:
+    std::string entryPath(vm::u8 inputHash) const;
+    // nullptr on a miss
+    std::shared_ptr<const vm::Program> read(const std::string& entry, vm::u8 inputHash,
+                                            const vm::u1* input, std::size_t inputSize) const;
+    void write(const std::string& entry, vm::u8 inputHash, const vm::u1* input, std::size_t inputSize,
+               const vm::Program& program) const;
+
+private:
+    std::string _dir;
+    bool _hit;
+};
+
+#endif
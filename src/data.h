@@ -0,0 +1,22 @@
+#ifndef DATA_H_INCLUDED
+#define DATA_H_INCLUDED
+
+#include "./type.h"
+
+#include <utility>
+#include <vector>
+
+namespace vm {
+
+// the globals left behind by a .start evaluated ahead of time:
+// the stack [0, stack.size()), the heap allocations in order
+// and the heap content from its first address to the end of the last allocation
+struct DataSection {
+    std::vector<slot_t> stack;
+    std::vector<std::pair<addr_t, addr_t>> heapRecord;
+    std::vector<slot_t> heap;
+};
+
+}
+
+#endif
@@ -90,6 +90,17 @@ public:
     }
 };
 
+class LimitExceeded : public std::exception {
+public:
+    LimitExceeded(std::string msg) : msg(std::move(msg)) {}
+    virtual ~LimitExceeded() {}
+    virtual const char* what() const noexcept {
+        return msg.c_str();
+    }
+private:
+    std::string msg;
+};
+
 }
 
 #endif
\ No newline at end of file
@@ -5,60 +5,124 @@
 #include "./function.h"
 #include "./exception.h"
 #include "./util/print.hpp"
+#include "./util/parallel.hpp"
+#include "./util/mapped_file.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
+#include <optional>
 #include <algorithm>
+#include <charconv>
+#include <cstring>
 
 File::File(
     vm::u4 version, 
     std::vector<vm::Constant> constants, 
     std::vector<vm::Instruction> instructions, 
     std::vector<vm::Function> functions
-) : version(version), constants(constants), start(instructions), functions(functions) {
-    //
+) : version(version), constants(std::move(constants)), start(std::move(instructions)), functions(std::move(functions)) {
+    decodedCount = this->functions.size();
 }
 
 
-void File::output_text(std::ostream& out) {
+namespace {
+
+// the disassembler appends to per-function buffers instead of going through print()
+void appendUInt(std::string& buf, vm::u8 v) {
+    char digits[16];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof digits, v);
+    buf.append(digits, end);
+}
+
+void appendInstructions(std::string& buf, const std::vector<vm::Instruction>& instructions,
+                        const std::vector<vm::u8>* hits = nullptr) {
+    vm::u4 j = 0;
+    for (auto& ins : instructions) {
+        auto& info = vm::infoOf(ins.op);
+        appendUInt(buf, j++);
+        buf += ' ';
+        buf += info.name;
+        switch (info.paramCount) {
+        case 0: break;
+        case 1: buf += ' '; appendUInt(buf, ins.x); break;
+        case 2: buf += ' '; appendUInt(buf, ins.x); buf += ','; appendUInt(buf, ins.y); break;
+        }
+        if (hits != nullptr) {
+            buf += " # ";
+            appendUInt(buf, j - 1 < hits->size() ? (*hits)[j - 1] : 0);
+        }
+        buf += '\n';
+    }
+}
+
+}
+
+void File::output_text(std::ostream& out, const std::vector<std::vector<vm::u8>>* hits) {
+    decode_all();
     int i;
     
+    // the constants go through print(), whose stream flags carry over between constants
+    std::ostringstream head;
+    head.copyfmt(out);
     i = 0;
-    println(out, ".constants:");
+    println(head, ".constants:");
     for (auto& constant : constants) {
-        println(out, i++, constant);
+        println(head, i++, constant);
     }
+    out.copyfmt(head);
 
-    i = 0;
-    println(out, ".start:");
-    for (auto& ins : start) {
-        println(out, i++, ins);
+    std::string buf = head.str();
+    buf += ".start:\n";
+    if (data) {
+        buf += "# baked into the data section\n";
     }
+    appendInstructions(buf, start, hits != nullptr ? &hits->at(0) : nullptr);
 
-    std::vector<std::string> names;
+    std::vector<const std::string*> names;
+    buf += ".functions:\n";
     i = 0;
-    println(out, ".functions:");
     for (auto& fun : functions) {
-        std::string name = std::get<std::string>(constants.at(fun.nameIndex).value);
-        names.push_back(name);
-        println(out, i++, fun.nameIndex, fun.paramSize, fun.level, "#", name);
+        names.push_back(&std::get<std::string>(constants.at(fun.nameIndex).value));
+        appendUInt(buf, i++);
+        buf += ' '; appendUInt(buf, fun.nameIndex);
+        buf += ' '; appendUInt(buf, fun.paramSize);
+        buf += ' '; appendUInt(buf, fun.level);
+        buf += " # ";
+        buf += *names.back();
+        buf += '\n';
     }
-    
-    i = 0;
-    for (auto& fun : functions) {
-        printfmt(out, ".F{}: # {}", i, names.at(i)); println(out);
-        int j = 0;
-        for (auto& ins : fun.instructions) {
-            println(out, j++, ins);
+    out.write(buf.data(), buf.size());
+
+    // format the bodies on workers, a batch at a time, and write them in order
+    const std::size_t batchSize = 256;
+    std::vector<std::string> bodies(std::min(batchSize, functions.size()));
+    for (std::size_t bg = 0; bg < functions.size(); bg += batchSize) {
+        std::size_t count = std::min(batchSize, functions.size() - bg);
+        parallel_for(count, [&](std::size_t k) {
+            auto& body = bodies[k];
+            body.clear();
+            body += ".F";
+            appendUInt(body, bg + k);
+            body += ": # ";
+            body += *names[bg + k];
+            body += '\n';
+            appendInstructions(body, functions[bg + k].instructions, hits != nullptr ? &hits->at(bg + k + 1) : nullptr);
+        }, count < 16 ? 1 : default_thread_count());
+        buf.clear();
+        for (std::size_t k = 0; k < count; ++k) {
+            buf += bodies[k];
         }
-        ++i;
+        out.write(buf.data(), buf.size());
     }
+    out.flush();
 }
 
 void File::output_binary(std::ofstream& out) {
+    decode_all();
 
     char bytes[8];
     const auto writeNBytes = [&](void* addr, int count) {
@@ -72,8 +136,8 @@ void File::output_binary(std::ofstream& out) {
 
     // magic
     out.write("\x43\x30\x3A\x29", 4);
-    // version
-    out.write("\x00\x00\x00\x01", 4);
+    // version, 2 has a data section
+    out.write(data ? "\x00\x00\x00\x02" : "\x00\x00\x00\x01", 4);
     // constants_count
     vm::u2 constants_count = constants.size();
     writeNBytes(&constants_count, sizeof constants_count);
@@ -108,8 +172,8 @@ void File::output_binary(std::ofstream& out) {
         for (auto& ins : v) {
             vm::u1 op = static_cast<vm::u1>(ins.op); 
             writeNBytes(&op, sizeof op);
-            if (auto it = vm::paramSizeOfOpCode.find(ins.op); it != vm::paramSizeOfOpCode.end()) {
-                auto paramSizes = it->second;
+            if (auto& info = vm::infoOf(ins.op); info.paramCount != 0) {
+                auto& paramSizes = info.paramSizes;
                 switch (paramSizes[0]) {
                 #define CASE(n) case n: { vm::u##n x = ins.x; writeNBytes(&x, n); }
                 CASE(1); break; 
@@ -118,7 +182,7 @@ void File::output_binary(std::ofstream& out) {
                 #undef CASE
                 default: assert(("unexpected error", false));
                 }
-                if (paramSizes.size() == 2) {
+                if (info.paramCount == 2) {
                     switch (paramSizes[1]) {
                     #define CASE(n) case n: { vm::u##n y = ins.y; writeNBytes(&y, n); }
                     CASE(1); break; 
@@ -145,83 +209,178 @@ void File::output_binary(std::ofstream& out) {
         v = fun.level;     writeNBytes(&v, sizeof v);
         to_binary(fun.instructions);
     }
+    if (data) {
+        // slots are stored as runs of non-zero slots: runs_count, then offset, count and the slots of each
+        const auto to_runs = [&](const std::vector<vm::slot_t>& slots) {
+            std::vector<std::pair<vm::u4, vm::u4>> runs;
+            for (std::size_t i = 0, n = slots.size(); i < n; ) {
+                if (slots[i] == 0) {
+                    ++i;
+                    continue;
+                }
+                // short gaps of zeros are cheaper inline than a new run
+                std::size_t end = i + 1;
+                for (std::size_t j = end; j < n && j < end + 16; ++j) {
+                    if (slots[j] != 0) {
+                        end = j + 1;
+                    }
+                }
+                runs.emplace_back(i, end - i);
+                i = end;
+            }
+            vm::u4 runs_count = runs.size();
+            writeNBytes(&runs_count, sizeof runs_count);
+            for (auto [offset, count] : runs) {
+                writeNBytes(&offset, sizeof offset);
+                writeNBytes(&count, sizeof count);
+                for (auto k = offset; k < offset + count; ++k) {
+                    vm::slot_t slot = slots[k];
+                    writeNBytes(&slot, sizeof slot);
+                }
+            }
+        };
+        vm::u4 n = data->stack.size();
+        writeNBytes(&n, sizeof n);
+        to_runs(data->stack);
+        n = data->heapRecord.size();
+        writeNBytes(&n, sizeof n);
+        for (auto [addr, size] : data->heapRecord) {
+            writeNBytes(&addr, sizeof addr);
+            writeNBytes(&size, sizeof size);
+        }
+        n = data->heap.size();
+        writeNBytes(&n, sizeof n);
+        to_runs(data->heap);
+    }
 }
 
-File File::parse_file_binary(std::ifstream& in) {
-    // read raw
-    const std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(in), {});
-    size_t pos = 0;
-    const auto bufferSize = buffer.size();
-    const auto readByte = [&]() {
-        if (pos + 1 > bufferSize) {
+namespace {
+
+// the VM stack and heap sizes, a data section never holds more
+const vm::u4 MAX_DATA_SLOTS = 0x01000000;
+
+inline vm::u4 loadBigEndian(const vm::u1* p, int count) {
+    switch (count) {
+    case 1: return p[0];
+    case 2: return (vm::u4(p[0]) << 8) | p[1];
+    case 4: return (vm::u4(p[0]) << 24) | (vm::u4(p[1]) << 16) | (vm::u4(p[2]) << 8) | p[3];
+    default: return 0;
+    }
+}
+
+// reads the whole stream in one block when its size is known
+template <typename Container>
+void readAll(std::istream& in, Container& buffer) {
+    in.seekg(0, std::ios::end);
+    if (auto size = in.tellg(); size > 0) {
+        buffer.resize(static_cast<std::size_t>(size));
+        in.seekg(0, std::ios::beg);
+        in.read(reinterpret_cast<char*>(&buffer[0]), buffer.size());
+        buffer.resize(static_cast<std::size_t>(in.gcount()));
+    }
+    else {
+        in.clear();
+        in.seekg(0, std::ios::beg);
+        buffer.assign(std::istreambuf_iterator<char>(in), {});
+    }
+}
+
+// checks a body of count instructions starting at p, returns its end
+const vm::u1* scanInstructions(const vm::u1* p, const vm::u1* end, int count) {
+    for (int k = 0; k < count; ++k) {
+        if (p == end) {
             throw InvalidFile("incomplete binary file");
         }
-        vm::u1 rtv = static_cast<vm::u1>(buffer[pos]);
-        pos += 1;
-        return rtv;
-    };
-    const auto read2bytes = [&] {
-        if (pos + 2 > bufferSize) {
-            throw InvalidFile("incomplete binary file");
+        auto& info = vm::opCodeInfo[*p++];
+        if (info.name == nullptr) {
+            throw InvalidFile("invalid binary file: invalid opcode");
         }
-        vm::u2 rtv = static_cast<vm::u2>(
-            (buffer[pos] << 8) | buffer[pos+1]
-        );
-        pos += 2;
-        return rtv;
-    };
-    const auto read4bytes = [&]() {
-        if (pos + 4 > bufferSize) {
+        if (static_cast<std::size_t>(end - p) < info.size) {
             throw InvalidFile("incomplete binary file");
         }
-        vm::u4 rtv = static_cast<vm::u4>(
-            (buffer[pos] << 24) | (buffer[pos+1] << 16) | (buffer[pos+2] << 8) | buffer[pos+3]
-        );
-        pos += 4;
+        p += info.size;
+    }
+    return p;
+}
+
+// decodes a body already checked by scanInstructions
+void decodeInstructions(const vm::u1* p, int count, std::vector<vm::Instruction>& v) {
+    v.resize(count);
+    for (auto& ins : v) {
+        auto& info = vm::opCodeInfo[*p];
+        ins.op = static_cast<vm::OpCode>(*p++);
+        ins.x = loadBigEndian(p, info.paramSizes[0]);
+        ins.y = loadBigEndian(p + info.paramSizes[0], info.paramSizes[1]);
+        p += info.size;
+    }
+}
+
+}
+
+std::vector<vm::Instruction>& File::instructions_of(std::size_t index) {
+    auto& fun = functions.at(index);
+    if (fun.body != nullptr) {
+        decodeInstructions(fun.body, fun.bodyCount, fun.instructions);
+        fun.body = nullptr;
+        ++decodedCount;
+    }
+    return fun.instructions;
+}
+
+void File::decode_all() {
+    for (std::size_t i = 0; i < functions.size(); ++i) {
+        instructions_of(i);
+    }
+}
+
+File File::parse_file_binary(std::ifstream& in, bool lazy) {
+    // read raw
+    auto buffer = std::make_shared<std::vector<vm::u1>>();
+    readAll(in, *buffer);
+    File file = parse_binary(buffer->data(), buffer->size(), lazy);
+    if (lazy) {
+        file.image = std::move(buffer);
+    }
+    return file;
+}
+
+File File::parse_file_binary(const std::string& path, bool lazy) {
+    auto mapping = std::make_shared<MappedFile>(path);
+    if (!mapping->opened()) {
+        throw InvalidFile("cannot open input file");
+    }
+    if (!mapping->mapped()) {
+        std::ifstream in(path, std::ios::binary | std::ios::in);
+        return parse_file_binary(in, lazy);
+    }
+    File file = parse_binary(mapping->data(), mapping->size(), lazy);
+    if (lazy) {
+        file.image = std::move(mapping);
+    }
+    return file;
+}
+
+File File::parse_binary(const vm::u1* data, std::size_t size, bool lazy) {
+    const vm::u1* p = data;
+    const vm::u1* const end = data + size;
+    #define ENSURE_BYTES(n, msg) do { if (static_cast<std::size_t>(end - p) < static_cast<std::size_t>(n)) { throw InvalidFile(msg); } } while(false)
+    const auto read2bytes = [&] {
+        ENSURE_BYTES(2, "incomplete binary file");
+        auto rtv = static_cast<vm::u2>(loadBigEndian(p, 2));
+        p += 2;
         return rtv;
     };
-    const auto readDouble = [&]() {
-        if (pos + 8 > bufferSize) {
-            throw InvalidFile("invalid binary file: incomplete double constant");
-        }
-        union {
-            vm::double_t d;
-            unsigned char b[8];
-        } rtv;
-        for (int i = 7; i >= 0; --i) {
-            rtv.b[i] = buffer[pos++];
-        }
-        return rtv.d;
-    };
-    const auto readString = [&](vm::u2 length) {
-        if (pos + length > bufferSize) {
-            throw InvalidFile("invalid binary file: incomplete string constant");
-        }
-        vm::str_t rtv;
-        while (length-- ) {
-            rtv += buffer[pos++];
-        }
+    const auto read4bytes = [&] {
+        ENSURE_BYTES(4, "incomplete binary file");
+        auto rtv = loadBigEndian(p, 4);
+        p += 4;
         return rtv;
     };
-    const auto readInstruction = [&]() {
-        vm::Instruction ins;
-        ins.op = static_cast<vm::OpCode>(readByte());
-        if (vm::nameOfOpCode.count(ins.op) == 0) {
-            throw InvalidFile("invalid binary file: invalid opcode");
-        }
-        if (auto it = vm::paramSizeOfOpCode.find(ins.op); it != vm::paramSizeOfOpCode.end()) {
-            auto paramSizes = it->second;
-            switch (paramSizes[0]) {
-            case 1: ins.x = readByte(); break;
-            case 2: ins.x = read2bytes(); break;
-            case 4: ins.x = read4bytes(); break;
-            default: assert(("unexpected error", false));
-            }
-            if (paramSizes.size() == 2) {
-                ins.y = read4bytes();
-            }
-        }
-        return ins;
+    const auto readInstructions = [&](std::vector<vm::Instruction>& v) {
+        auto instructionsCount = read2bytes();
+        auto body = p;
+        p = scanInstructions(p, end, instructionsCount);
+        decodeInstructions(body, instructionsCount, v);
     };
 
     // parse magic
@@ -235,41 +394,43 @@ File File::parse_file_binary(std::ifstream& in) {
 
     // parse constants
     auto constantsCount = read2bytes();
-    std::vector<vm::Constant> constants;
-    for (int j = 0; j < constantsCount; ++j) {
-        vm::Constant constant;
-        constant.type = static_cast<vm::Constant::Type>(readByte());
+    std::vector<vm::Constant> constants(constantsCount);
+    for (auto& constant : constants) {
+        ENSURE_BYTES(1, "incomplete binary file");
+        constant.type = static_cast<vm::Constant::Type>(*p++);
         switch (constant.type)
         {
         case vm::Constant::Type::STRING: {
             auto length = read2bytes();
-            constant.value = std::move(readString(length));
+            ENSURE_BYTES(length, "invalid binary file: incomplete string constant");
+            constant.value = vm::str_t(reinterpret_cast<const char*>(p), length);
+            p += length;
         } break;
         case vm::Constant::Type::INT: {
             constant.value = static_cast<vm::int_t>(read4bytes());
         } break;
         case vm::Constant::Type::DOUBLE: {
-            constant.value = readDouble();
+            ENSURE_BYTES(8, "invalid binary file: incomplete double constant");
+            vm::u8 bits = (vm::u8(loadBigEndian(p, 4)) << 32) | loadBigEndian(p + 4, 4);
+            vm::double_t d;
+            std::memcpy(&d, &bits, sizeof d);
+            constant.value = d;
+            p += 8;
         } break;
         default:
             throw InvalidFile("invalid binary file: invalid constant type");
         }
-        constants.push_back(std::move(constant));
     }
 
     // parse start
-    auto instructionsCount = read2bytes();
     std::vector<vm::Instruction> start;
-    for (int j = 0; j < instructionsCount; ++j) {
-        start.push_back(std::move(readInstruction()));
-    }
+    readInstructions(start);
 
     // parse functions
     auto functionsCount = read2bytes();
-    std::vector<vm::Function> functions;
+    std::vector<vm::Function> functions(functionsCount);
     bool mainFound = false;
-    for (int j = 0; j < functionsCount; ++j) {
-        vm::Function fun;
+    for (auto& fun : functions) {
         fun.nameIndex = read2bytes();
         if (fun.nameIndex >= constants.size()) {
             throw InvalidFile("invalid binary file: function name not found");
@@ -282,153 +443,288 @@ File File::parse_file_binary(std::ifstream& in) {
         }
         fun.paramSize = read2bytes();
         fun.level = read2bytes();
-        auto instructionsCount = read2bytes();
-        for (int k = 0; k < instructionsCount; ++k) {
-            fun.instructions.push_back(std::move(readInstruction()));
+        if (lazy) {
+            // only remember where the body is, it is decoded on its first call
+            fun.bodyCount = read2bytes();
+            fun.body = p;
+            p = scanInstructions(p, end, fun.bodyCount);
+        }
+        else {
+            readInstructions(fun.instructions);
         }
-        functions.push_back(std::move(fun));
     }
 
+    // parse data
+    std::optional<vm::DataSection> data;
+    if (version == 2) {
+        const auto readSlots = [&](std::vector<vm::slot_t>& slots) {
+            auto size = read4bytes();
+            if (size > MAX_DATA_SLOTS) {
+                throw InvalidFile("invalid binary file: data section too large");
+            }
+            slots.assign(size, 0);
+            auto runsCount = read4bytes();
+            for (vm::u4 i = 0; i < runsCount; ++i) {
+                auto offset = read4bytes();
+                auto count = read4bytes();
+                if (offset > size || count > size - offset) {
+                    throw InvalidFile("invalid binary file: data out of range");
+                }
+                ENSURE_BYTES(std::size_t(count) * 4, "incomplete binary file");
+                for (auto k = offset; k < offset + count; ++k, p += 4) {
+                    slots[k] = static_cast<vm::slot_t>(loadBigEndian(p, 4));
+                }
+            }
+        };
+        data.emplace();
+        readSlots(data->stack);
+        auto recordsCount = read4bytes();
+        for (vm::u4 i = 0; i < recordsCount; ++i) {
+            auto addr = static_cast<vm::addr_t>(read4bytes());
+            auto size = static_cast<vm::addr_t>(read4bytes());
+            data->heapRecord.emplace_back(addr, size);
+        }
+        readSlots(data->heap);
+    }
+    #undef ENSURE_BYTES
+
     if (!mainFound) {
         throw InvalidFile("invalid binary file: main() not found");
     }
 
-    if (pos != buffer.size()) {
+    if (p != end) {
         throw InvalidFile("invalid binary file: unused content");
     }
 
-    return File{version, std::move(constants), std::move(start), std::move(functions)};
+    File file{version, std::move(constants), std::move(start), std::move(functions)};
+    file.data = std::move(data);
+    if (lazy) {
+        file.decodedCount = 0;
+    }
+    return file;
 }
 
-File File::parse_file_text(std::ifstream& in) {
-    int line_count = 0;
-    std::string line = "";
-    std::string str = "";
-    std::stringstream ss;
-    const auto readLine = [&]() {
-        while(std::getline(in, line)) {
-            ++line_count;
+namespace {
+
+// single pass lexer over the whole text file,
+// lines and tokens are views into the buffer
+class TextLexer {
+public:
+    // a line and the position after it
+    struct Mark {
+        std::size_t next;
+        int lineCount;
+        std::string_view line;
+    };
+
+    explicit TextLexer(std::string_view text, int lineCount = 0) : _text(text), _lineCount(lineCount) {}
+
+    // next line that is not blank after removing the comment and leading whitespaces,
+    // false at eof (the line is empty then)
+    bool nextLine() {
+        while (_next < _text.size()) {
+            auto ed = _text.find('\n', _next);
+            if (ed == std::string_view::npos) {
+                ed = _text.size();
+            }
+            auto raw = _text.substr(_next, ed - _next);
+            _next = ed + 1;
+            ++_lineCount;
             // remove comment
-            if (auto ed = line.find_first_of('#'); ed != std::string::npos) {
-                line.resize(ed); 
-                // line.erase(line.begin()+ed, line.end());
+            if (auto cm = raw.find('#'); cm != std::string_view::npos) {
+                raw = raw.substr(0, cm);
             }
-            // remove leading and trailing whitespaces
-            line = trim(std::move(line));
-            // not a blank line     
-            if (!line.empty()) {
-                ss.str(line);
-                ss.clear();
-                return;
+            // remove leading whitespaces
+            std::size_t bg = 0;
+            while (bg < raw.size() && is_space(raw[bg])) {
+                ++bg;
+            }
+            if (bg < raw.size()) {
+                _line = raw.substr(bg);
+                _pos = 0;
+                return true;
             }
         }
         // eof
-        line = "";
-        ss.str("");
-        ss.clear();
-    };
-    const auto reuseLine = [&]() {
-        ss.str(line);
-        ss.clear();
-    };
-    const auto errorLineInfo = [&]() {
-        println(std::cerr, "line", line_count, ":\n   ", line);
-    };
-    const auto errorInvalidFile = [&](std::string msg) {
-        errorLineInfo();
-        throw InvalidFile(msg);
-    };
-    #define errorIf(cond, msg)    do { if ((cond)) { errorInvalidFile((msg)); } } while(false)
+        _line = {};
+        _pos = 0;
+        return false;
+    }
+    void rewind() {
+        _pos = 0;
+    }
+    bool token(std::string_view& tok) {
+        skipSpaces();
+        if (_pos == _line.size()) {
+            return false;
+        }
+        auto bg = _pos;
+        while (_pos < _line.size() && !is_space(_line[_pos])) {
+            ++_pos;
+        }
+        tok = _line.substr(bg, _pos - bg);
+        return true;
+    }
+    bool nonSpace(char& ch) {
+        skipSpaces();
+        return get(ch);
+    }
+    bool get(char& ch) {
+        if (_pos == _line.size()) {
+            return false;
+        }
+        ch = _line[_pos++];
+        return true;
+    }
+    std::string_view rest() {
+        auto rtv = _line.substr(_pos);
+        _pos = _line.size();
+        return rtv;
+    }
+    bool atEnd() {
+        skipSpaces();
+        return _pos == _line.size();
+    }
+    // anything but whitespaces after the current line
+    bool hasMoreContent() const {
+        for (auto i = _next; i < _text.size(); ++i) {
+            if (!is_space(_text[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+    int lineCount() const { return _lineCount; }
+    std::string_view line() const { return _line; }
+    std::string_view text() const { return _text; }
+    Mark mark() const { return Mark{_next, _lineCount, _line}; }
+    void seek(const Mark& m) {
+        _next = m.next;
+        _lineCount = m.lineCount;
+        _line = m.line;
+        _pos = 0;
+    }
+
+private:
+    void skipSpaces() {
+        while (_pos < _line.size() && is_space(_line[_pos])) {
+            ++_pos;
+        }
+    }
+
+private:
+    std::string_view _text;
+    std::size_t _next = 0;
+    int _lineCount;
+    std::string_view _line;
+    std::size_t _pos = 0;
+};
+
+// an error found by the text assembler, printed by parse_file_text
+struct LineError {
+    int lineCount;
+    std::string_view line;
+    std::string msg;
+};
+
+}
+
+namespace {
+
+// throws LineError, see File::parse_file_text
+File parseText(std::string_view text) {
+    TextLexer lex(text);
+    std::string_view str;
+    // reports on the lexer named lex in the scope
+    #define errorIf(cond, msg)    do { if ((cond)) { throw LineError{lex.lineCount(), lex.line(), (msg)}; } } while(false)
     #define errorIfNot(cond, msg) errorIf(!(cond), (msg))
-    #define errorIfAssignFailed(lhs, rhs, msg) do { try { lhs = (rhs); } catch (const std::exception&) { errorIf(true, (msg)); } } while(false)
-    auto ensureNoMoreInput = [&]() {
-        if (char ch; ss >> std::skipws >> ch) {
-            errorIf(true, "invalid line");
+    #define errorIfParseFailed(lhs, parse, text, msg) do { std::int32_t _v; errorIfNot(parse((text), _v), (msg)); lhs = _v; } while(false)
+    const auto ensureNoMoreInput = [](TextLexer& lex) {
+        errorIfNot(lex.atEnd(), "invalid line");
+    };
+    // "{index} ..." lines, false with the line rewound if there is no index
+    const auto readIndexedLine = [](TextLexer& lex, int& index) {
+        std::string_view temp;
+        lex.nextLine();
+        if (!lex.token(temp) || !parse_int(temp, index)) {
+            lex.rewind();
+            return false;
         }
+        return true;
     };
 
-    readLine();
+    lex.nextLine();
 
     // parse constants
     std::vector<vm::Constant> constants;
-    ss >> str;
+    lex.token(str);
     if (str == ".constants:") {
-        ensureNoMoreInput();
-        while (true) {
-            // {index} {type} {value}
-            readLine();
+        ensureNoMoreInput(lex);
+        int index;
+        // {index} {type} {value}
+        while (readIndexedLine(lex, index)) {
             vm::Constant constant;
-            std::string temp;
-            int index;
-            std::string type;
-            std::string value;
-            // eof
-            if (!(ss >> temp)) { 
-                reuseLine(); break; 
-            }
-            // parse index
-            try {
-                index = try_to_int(temp);
-            }
-            catch (const std::exception&) {
-                reuseLine(); break;
-            }
+            std::string_view type;
+            std::string_view value;
             errorIf(index != constants.size(), "unordered index");
-            errorIfNot(ss >> type, "constant type expected");
+            errorIfNot(lex.token(type), "constant type expected");
             if (type == "S") {
                 constant.type = vm::Constant::Type::STRING;
+                std::string content;
                 char ch;
-                errorIfNot(ss >> std::skipws >> ch, "string constant expected");
+                errorIfNot(lex.nonSpace(ch), "string constant expected");
                 errorIf(ch != '\"', "no leading qoute for string constant");
                 // parse the content of string
                 while (true) {
-                    errorIfNot(ss.get(ch), "no trailing quote for string constant");
+                    errorIfNot(lex.get(ch), "no trailing quote for string constant");
                     if (ch == '\"') { 
                         break; 
                     }
                     if (ch == '\\') {
-                        errorIfNot(ss.get(ch), "incomplete escape seq");
+                        errorIfNot(lex.get(ch), "incomplete escape seq");
                         switch (ch) {
-                        case '\\': value += '\\'; break;
-                        case '\'': value += '\''; break;
-                        case '\"': value += '\"'; break;
-                        case 'n':  value += '\n'; break;
-                        case 'r':  value += '\r'; break;
-                        case 't':  value += '\t'; break;
+                        case '\\': content += '\\'; break;
+                        case '\'': content += '\''; break;
+                        case '\"': content += '\"'; break;
+                        case 'n':  content += '\n'; break;
+                        case 'r':  content += '\r'; break;
+                        case 't':  content += '\t'; break;
                         case 'x': {
-                            errorIfNot(ss.get(ch), "incomplete hex escape seq");
+                            errorIfNot(lex.get(ch), "incomplete hex escape seq");
                             errorIfNot(is_hex_digit(ch), "invalid hex escape seq");
                             char v = (0xff & hex_digit_to_int(ch)) << 4;
-                            errorIfNot(ss.get(ch), "incomplete hex escape seq");
+                            errorIfNot(lex.get(ch), "incomplete hex escape seq");
                             errorIfNot(is_hex_digit(ch), "invalid hex escape seq");
                             v |= (0xff & hex_digit_to_int(ch));
-                            value += v;
+                            content += v;
                         }; break;
                         default: errorIf(true, strfmt("unknown escape seq \"\\{}\"", ch));
                         }
                     }
                     else {
-                        value += ch;
+                        content += ch;
                     }
                 }
-                errorIf(value.length() > UINT16_MAX, "too long the string constant");
-                constant.value = std::move(value);
+                errorIf(content.length() > UINT16_MAX, "too long the string constant");
+                constant.value = std::move(content);
             }
             else if (type == "I") {
                 constant.type = vm::Constant::Type::INT;
-                errorIfNot(ss >> std::skipws >> value, "invalid format");
-                errorIfAssignFailed(constant.value, try_to_int(value), "out of range or invalid format");
+                errorIfNot(lex.token(value), "invalid format");
+                errorIfParseFailed(constant.value, parse_int, value, "out of range or invalid format");
             }
             else if (type == "D") {
                 constant.type = vm::Constant::Type::DOUBLE;
-                errorIfNot(ss >> std::skipws >> value, "invalid format");
-                errorIfAssignFailed(constant.value, try_to_double(value), "out of range or invalid format");
+                errorIfNot(lex.token(value), "invalid format");
+                vm::double_t d;
+                errorIfNot(parse_double(value, d), "out of range or invalid format");
+                constant.value = d;
             }
             else {
                 errorIf(true, "invalid constant type");
             }
             constants.push_back(std::move(constant));
-            ensureNoMoreInput();
+            ensureNoMoreInput(lex);
         }
     }
     else {
@@ -437,51 +733,46 @@ File File::parse_file_text(std::ifstream& in) {
     errorIf(constants.size() > U2_MAX, "too many constants");
 
     // parse instructions
-    auto parseInstructions = [&]() {
+    const auto parseInstructions = [&](TextLexer& lex) {
         std::vector<vm::Instruction> rtv;
-        while(true) {
-            // {index} {opcode} {param1} {param2}
-            readLine();
-            std::string temp;
-            int index;
-            std::string opName;
-            // eof
-            if (!(ss >> temp)) { 
-                reuseLine(); break; 
-            }
-            // parse index
-            try {
-                index = try_to_int(temp);
-            }
-            catch (const std::exception&) {
-                reuseLine(); break;
-            }
+        int index;
+        // {index} {opcode} {param1} {param2}
+        while (readIndexedLine(lex, index)) {
+            std::string_view opName;
             errorIf(index != rtv.size(), "unordered index");
-            errorIfNot(ss >> opName, "opcode expected");
-            opName = to_lower(opName);
-            vm::Instruction ins;
-            if (auto it = vm::opCodeOfName.find(opName); true) {
-                errorIf(it == vm::opCodeOfName.end(), "no such opcode");
-                ins.op = it->second;
-            }
-            if (auto it = vm::paramSizeOfOpCode.find(ins.op); it != vm::paramSizeOfOpCode.end()) {
-                int paramCount = it->second.size();
-                std::string restLine;
-                errorIfNot(std::getline(ss, restLine), "parameters expected");
-                auto params = split(restLine, ',');
-                errorIf(params.size() != paramCount, 
-                    strfmt("{} parameters expected, {} got", paramCount, params.size())
+            errorIfNot(lex.token(opName), "opcode expected");
+            vm::Instruction ins{};
+            errorIfNot(vm::findOpCode(opName, ins.op), "no such opcode");
+            if (int paramCount = vm::infoOf(ins.op).paramCount; paramCount != 0) {
+                auto restLine = lex.rest();
+                errorIf(restLine.empty(), "parameters expected");
+                // split by ','
+                std::string_view params[2];
+                int got = 0;
+                for (std::size_t bg = 0; true; ++got) {
+                    auto ed = restLine.find(',', bg);
+                    if (got < 2) {
+                        params[got] = restLine.substr(bg, ed == std::string_view::npos ? ed : ed - bg);
+                    }
+                    if (ed == std::string_view::npos) {
+                        ++got;
+                        break;
+                    }
+                    bg = ed + 1;
+                }
+                errorIf(got != paramCount, 
+                    strfmt("{} parameters expected, {} got", paramCount, got)
                 );
-                errorIfAssignFailed(ins.x, try_to_int(params[0]), 
+                errorIfParseFailed(ins.x, parse_int, params[0], 
                     strfmt("invalid first parameter: {}", params[0])
                 );
                 if (paramCount == 2) {
-                    errorIfAssignFailed(ins.y, try_to_int(params[1]), 
+                    errorIfParseFailed(ins.y, parse_int, params[1], 
                         strfmt("invalid second parameter: {}", params[1])
                     );
                 }
             }
-            ensureNoMoreInput();
+            ensureNoMoreInput(lex);
             rtv.push_back(ins);
         }
         errorIf(rtv.size() > U2_MAX, "too many instructions");
@@ -490,10 +781,10 @@ File File::parse_file_text(std::ifstream& in) {
 
     // parse start
     std::vector<vm::Instruction> start;
-    ss >> str;
+    lex.token(str);
     if (str == ".start:") {
-        ensureNoMoreInput();
-        start = std::move(parseInstructions());
+        ensureNoMoreInput(lex);
+        start = parseInstructions(lex);
     }
     else {
         errorIf(true, ".start expected");
@@ -502,42 +793,30 @@ File File::parse_file_text(std::ifstream& in) {
     // parse functions
     std::vector<vm::Function> functions;
     bool mainFound = false;
-    ss >> str;
+    lex.token(str);
     if (str == ".functions:") {
-        ensureNoMoreInput();
-        while (true) {
-            // {index} {nameIndex} {paramSize} {level}
-            readLine();
+        ensureNoMoreInput(lex);
+        int index;
+        // {index} {nameIndex} {paramSize} {level}
+        while (readIndexedLine(lex, index)) {
             vm::Function function;
-            std::string temp;
-            int index;
-            // no more function
-            if (!(ss >> temp)) { 
-                reuseLine(); break; 
-            }
-            // parse index
-            try {
-                index = try_to_int(temp);
-            }
-            catch (const std::exception&) {
-                reuseLine(); break;
-            }
+            std::string_view temp;
             errorIf(index != functions.size(), "unordered index");
-            errorIfNot(ss >> temp, "name_index expected");
-            errorIfAssignFailed(function.nameIndex, try_to_int(temp), "invalid name_index");
+            errorIfNot(lex.token(temp), "name_index expected");
+            errorIfParseFailed(function.nameIndex, parse_int, temp, "invalid name_index");
             errorIf(function.nameIndex >= constants.size(), "name not found");
             errorIf(constants[function.nameIndex].type != vm::Constant::Type::STRING, "name not found");
             if (std::get<vm::str_t>(constants[function.nameIndex].value) == "main") {
                 mainFound = true;
             }
-            errorIfNot(ss >> temp, "param_size expected");
-            errorIfAssignFailed(function.paramSize, try_to_int(temp), "invalid param_size");
+            errorIfNot(lex.token(temp), "param_size expected");
+            errorIfParseFailed(function.paramSize, parse_int, temp, "invalid param_size");
             errorIf(function.paramSize > U2_MAX, "too many parameters");
-            errorIfNot(ss >> temp, "level expected");
-            errorIfAssignFailed(function.level, try_to_int(temp), "invalid level");
+            errorIfNot(lex.token(temp), "level expected");
+            errorIfParseFailed(function.level, parse_int, temp, "invalid level");
             errorIf(function.level > U2_MAX, "too high the level");
             functions.push_back(std::move(function));
-            ensureNoMoreInput();
+            ensureNoMoreInput(lex);
         }
     }
     else {
@@ -547,42 +826,114 @@ File File::parse_file_text(std::ifstream& in) {
 
     int functions_count = functions.size();
     errorIf(functions_count > U2_MAX, "too many functions");
+
+    // split the rest at the section headers, which are the lines without an index.
+    // headers[i] is the header of .F{i}, headers[functions_count] ends the last body
+    std::vector<TextLexer::Mark> headers;
+    headers.push_back(lex.mark());
+    while (headers.size() <= functions_count && lex.nextLine()) {
+        std::string_view temp;
+        int index;
+        if (!lex.token(temp) || !parse_int(temp, index)) {
+            headers.push_back(lex.mark());
+        }
+    }
+    while (headers.size() <= functions_count) {
+        // eof
+        headers.push_back(lex.mark());
+    }
+
+    // the headers are checked in order, up to the first bad one
+    std::vector<int> indexes;
+    std::optional<LineError> headerError;
     for (int i = 0; i < functions_count; ++i) {
-        errorIfNot(ss >> str, strfmt("\".F{}:\" expected", i));
-        errorIf((str.length() < 2 || str.back() != ':'), strfmt("\".F{}:\" expected", i));
-        str.pop_back();
-
-        int index = -1;
-        if (str.front() == '.') {
-            str.erase(str.begin());
-            ss.str(str);
-            ss.clear();
-            char ch;
-            ss >> std::skipws >> ch;
-            if ((ch == 'F' || ch == 'f')) {
-                // .Fx
-                std::string temp;
-                errorIfNot(ss >> temp, strfmt("\".F{}:\" expected", i));
-                errorIfAssignFailed(index, try_to_int(temp), "invalid function index");
-                errorIf(index != i, strfmt("\".F{}:\" expected", i));
+        lex.seek(headers[i]);
+        try {
+            errorIfNot(lex.token(str), strfmt("\".F{}:\" expected", i));
+            errorIf((str.length() < 2 || str.back() != ':'), strfmt("\".F{}:\" expected", i));
+            str.remove_suffix(1);
+
+            int index = -1;
+            if (str.front() == '.') {
+                // .Fx, the rest of the line is not checked
+                str.remove_prefix(1);
+                errorIf(str.empty(), strfmt("\".F{}:\" expected", i));
+                if (str.front() == 'F' || str.front() == 'f') {
+                    auto temp = str.substr(1);
+                    errorIf(temp.empty(), strfmt("\".F{}:\" expected", i));
+                    errorIfParseFailed(index, parse_int, temp, "invalid function index");
+                    errorIf(index != i, strfmt("\".F{}:\" expected", i));
+                }
+                else {
+                    errorIf(str.size() > 1, "invalid line");
+                }
+            }
+            else {
+                // str is name
+                index = -1;
+                for (auto j = 0; j < functions_count; ++j) {
+                    if (std::get<std::string>(constants.at(functions.at(j).nameIndex).value) == str) {
+                        index = j;
+                        break;
+                    }
+                } 
+                ensureNoMoreInput(lex);
             }
+            errorIf(index < 0, "no such function");
+            indexes.push_back(index);
         }
-        else {
-            // str is name
-            index = -1;
-            for (auto j = 0; j < functions_count; ++j) {
-                if (std::get<std::string>(constants.at(functions.at(j).nameIndex).value) == str) {
-                    index = j;
-                    break;
-                }
-            } 
+        catch (const LineError& e) {
+            headerError = e;
+            break;
         }
-        ensureNoMoreInput();
-        errorIf(index < 0, "no such function");
-        functions.at(index).instructions = std::move(parseInstructions());
     }
 
-    errorIf(in >> str, "unused content");
+    // the bodies are independent, each one is parsed up to the next header
+    int sections = indexes.size();
+    std::vector<std::vector<vm::Instruction>> bodies(sections);
+    std::vector<std::optional<LineError>> bodyErrors(sections);
+    parallel_for(sections, [&](std::size_t i) {
+        auto bg = std::min(headers[i].next, text.size());
+        auto ed = std::min(headers[i+1].next, text.size());
+        TextLexer body(text.substr(bg, ed - bg), headers[i].lineCount);
+        try {
+            bodies[i] = parseInstructions(body);
+        }
+        catch (const LineError& e) {
+            bodyErrors[i] = e;
+        }
+    }, sections < 16 ? 1 : default_thread_count());
+
+    // the first error in the file wins
+    for (int i = 0; i < sections; ++i) {
+        if (bodyErrors[i]) {
+            throw *bodyErrors[i];
+        }
+        functions.at(indexes[i]).instructions = std::move(bodies[i]);
+    }
+    if (headerError) {
+        throw *headerError;
+    }
+
+    lex.seek(headers[functions_count]);
+    errorIf(lex.hasMoreContent(), "unused content");
+    #undef errorIf
+    #undef errorIfNot
+    #undef errorIfParseFailed
 
     return File{0x00000001, std::move(constants), std::move(start), std::move(functions)};
 }
+
+}
+
+File File::parse_file_text(std::ifstream& in) {
+    std::string text;
+    readAll(in, text);
+    try {
+        return parseText(text);
+    }
+    catch (const LineError& e) {
+        println(std::cerr, "line", e.lineCount, ":\n   ", e.line);
+        throw InvalidFile(e.msg);
+    }
+}
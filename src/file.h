@@ -5,10 +5,14 @@
 #include "./instruction.h"
 #include "./constant.h"
 #include "./function.h"
+#include "./data.h"
 
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <memory>
+#include <optional>
+#include <string>
 
 struct File
 {
@@ -17,12 +21,26 @@ struct File
     std::vector<vm::Constant> constants;
     std::vector<vm::Instruction> start;
     std::vector<vm::Function> functions;
+    // present in version 2 binaries, .start has already been run and is empty
+    std::optional<vm::DataSection> data;
+    // keeps the raw input alive while some function bodies are not decoded
+    std::shared_ptr<const void> image;
+    std::size_t decodedCount = 0;
 
     File(vm::u4, std::vector<vm::Constant>, std::vector<vm::Instruction>, std::vector<vm::Function>);
 
     static File parse_file_text(std::ifstream& in);
-    static File parse_file_binary(std::ifstream& in);
-    void output_text(std::ostream& out);
+    // lazy: only the function table is read up front,
+    // each body is decoded by the first instructions_of() on it
+    static File parse_file_binary(std::ifstream& in, bool lazy = false);
+    // maps the file and decodes straight from the mapping
+    static File parse_file_binary(const std::string& path, bool lazy = false);
+    static File parse_binary(const vm::u1* data, std::size_t size, bool lazy = false);
+    std::vector<vm::Instruction>& instructions_of(std::size_t index);
+    void decode_all();
+    // hits: how many times each instruction ran, [0] for .start and [i+1] for function i,
+    // written as a comment after the instruction
+    void output_text(std::ostream& out, const std::vector<std::vector<vm::u8>>* hits = nullptr);
     void output_binary(std::ofstream& out);
 };
 
@@ -0,0 +1,86 @@
+#include "./forkserver.h"
+#include "./vm.h"
+#include "./io.h"
+
+#include <cerrno>
+#include <iostream>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+const int CONTROL_FD = 198;
+const int STATUS_FD = CONTROL_FD + 1;
+
+bool readWord(int fd, vm::u4& word) {
+    while (true) {
+        auto n = ::read(fd, &word, sizeof word);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n == sizeof word;
+    }
+}
+
+// until the standard input has data or its writer hangs up
+void waitForInput() {
+    pollfd p{STDIN_FILENO, POLLIN, 0};
+    while (::poll(&p, 1, -1) < 0 && errno == EINTR) {
+    }
+}
+
+bool writeWord(int fd, vm::u4 word) {
+    while (true) {
+        auto n = ::write(fd, &word, sizeof word);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n == sizeof word;
+    }
+}
+
+}
+
+bool run_fork_server(std::shared_ptr<const vm::Program> program, const vm::VM::Limits& limits) {
+    vm::FdOutput output(STDOUT_FILENO);
+    vm::FdInput input(STDIN_FILENO);
+    auto avm = vm::VM::make_vm(std::move(program), output, input, std::cerr);
+    avm->setLimits(limits);
+    // everything up to the first instruction happens once, in the server
+    avm->begin();
+
+    // the fuzzer waits for these four bytes before it sends the first test
+    if (!writeWord(STATUS_FD, 0)) {
+        return false;
+    }
+    for (vm::u4 control; readWord(CONTROL_FD, control); ) {
+        std::cout.flush();
+        auto child = ::fork();
+        if (child < 0) {
+            return false;
+        }
+        if (child == 0) {
+            ::close(CONTROL_FD);
+            ::close(STATUS_FD);
+            // the server may have been up for longer than the time limit
+            avm->restartBudget();
+            // the VM was begun cooperatively, a scan on an input that is not ready yet suspends it
+            while (avm->proceed(0) == vm::VM::Status::waitingForInput) {
+                waitForInput();
+            }
+            output.flush();
+            if (avm->limitExceeded()) {
+                ::_exit(3);
+            }
+            ::_exit(avm->error().empty() ? 0 : 1);
+        }
+        int status;
+        if (!writeWord(STATUS_FD, static_cast<vm::u4>(child)) || ::waitpid(child, &status, 0) < 0
+            || !writeWord(STATUS_FD, static_cast<vm::u4>(status))) {
+            return false;
+        }
+    }
+    return true;
+}
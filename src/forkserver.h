@@ -0,0 +1,17 @@
+#ifndef FORKSERVER_H_INCLUDED
+#define FORKSERVER_H_INCLUDED
+
+#include "./program.h"
+#include "./vm.h"
+
+#include <memory>
+
+// the fork server of AFL, on its control and status pipes (file descriptors 198 and 199).
+// the VM is set up once, every test then runs in a child forked from it,
+// which shares the decoded program and the initialized memory copy-on-write
+// and reads the standard input the fuzzer prepared.
+// a child exits with 0, 1 after a runtime error, or 3 when it exceeds one of the limits.
+// returns when the fuzzer closes the control pipe, false if there is none
+bool run_fork_server(std::shared_ptr<const vm::Program> program, const vm::VM::Limits& limits = vm::VM::Limits());
+
+#endif
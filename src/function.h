@@ -15,6 +15,9 @@ struct Function {
     u2 paramSize;
     u2 level;
     std::vector<vm::Instruction> instructions;
+    // encoded body not decoded yet, see File::instructions_of
+    const u1* body = nullptr;
+    u2 bodyCount = 0;
 };
 
 }
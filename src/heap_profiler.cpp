@@ -0,0 +1,102 @@
+#include "./heap_profiler.h"
+#include "./util/print.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace vm {
+
+namespace {
+
+std::string whereOf(const Program& program, HeapProfiler::Site site) {
+    auto [functionIndex, ip] = site;
+    std::string name = ".start";
+    if (functionIndex >= 0) {
+        auto& function = program.functions().at(functionIndex);
+        name = std::get<str_t>(program.constants().at(function.nameIndex).value);
+    }
+    return name + ":" + std::to_string(ip);
+}
+
+std::size_t bucketOf(addr_t count) {
+    std::size_t bucket = 0;
+    for (auto c = static_cast<u4>(count); c != 0; c >>= 1) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+}
+
+HeapProfiler::HeapProfiler() : _sizes{}, _allocations(0), _slots(0) {
+}
+
+void HeapProfiler::allocated(Site site, addr_t count, u8 stack, addr_t used) {
+    auto& stats = _sites[site];
+    ++stats.allocations;
+    stats.slots += count;
+    stats.largest = std::max(stats.largest, count);
+    stats.stacks.insert(stack);
+    auto& size = _sizes[bucketOf(count)];
+    ++size.first;
+    size.second += count;
+    ++_allocations;
+    _slots += count;
+    if (!_initial) {
+        _initial = used - count;
+    }
+}
+
+void HeapProfiler::failed(Site site, addr_t count) {
+    _failure.emplace(site, count);
+}
+
+void HeapProfiler::report(const Program& program, addr_t heapUsed, std::ostream& out) const {
+    println(out, "heap high-water mark", heapUsed, "slots,", _initial.value_or(heapUsed), "of them before the first new");
+    println(out, _allocations, "allocations of", _slots, "slots");
+    if (_failure) {
+        println(out, "failed at", whereOf(program, _failure->first), "asking for", _failure->second, "slots");
+    }
+
+    // a site has a call stack for every different way it was reached
+    std::vector<std::pair<Site, const SiteStats*>> sites;
+    for (auto& [site, stats] : _sites) {
+        sites.emplace_back(site, &stats);
+    }
+    std::sort(sites.begin(), sites.end(), [](auto& a, auto& b) {
+        return a.second->slots != b.second->slots ? a.second->slots > b.second->slots : a.first < b.first;
+    });
+    out << std::fixed << std::setprecision(2);
+    out << '\n' << std::left << std::setw(24) << "site" << std::right << std::setw(14) << "allocations"
+        << std::setw(14) << "slots" << std::setw(9) << "%" << std::setw(12) << "largest"
+        << std::setw(9) << "stacks" << '\n';
+    for (auto [site, stats] : sites) {
+        out << std::left << std::setw(24) << whereOf(program, site) << std::right
+            << std::setw(14) << stats->allocations << std::setw(14) << stats->slots
+            << std::setw(9) << (_slots == 0 ? 0 : 100.0 * stats->slots / _slots)
+            << std::setw(12) << stats->largest << std::setw(9) << stats->stacks.size() << '\n';
+    }
+
+    out << '\n' << std::left << std::setw(24) << "size" << std::right << std::setw(14) << "allocations"
+        << std::setw(14) << "slots" << '\n';
+    for (std::size_t bucket = 0; bucket < _sizes.size(); ++bucket) {
+        auto [allocations, slots] = _sizes[bucket];
+        if (allocations == 0) {
+            continue;
+        }
+        std::string size = "0";
+        if (bucket == 1) {
+            size = "1";
+        }
+        else if (bucket > 1) {
+            size = std::to_string(u8(1) << (bucket - 1)) + "-" + std::to_string((u8(1) << bucket) - 1);
+        }
+        out << std::left << std::setw(24) << size << std::right << std::setw(14) << allocations
+            << std::setw(14) << slots << '\n';
+    }
+    out << std::defaultfloat << std::setprecision(6);
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef HEAP_PROFILER_H_INCLUDED
+#define HEAP_PROFILER_H_INCLUDED
+
+#include "./type.h"
+#include "./program.h"
+
+#include <array>
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <utility>
+
+namespace vm {
+
+// where the heap of a run went, for --heap-profile: every new by the instruction that executed it
+class HeapProfiler {
+public:
+    // the function, -1 for .start, and the index of the new instruction
+    using Site = std::pair<int, addr_t>;
+
+    HeapProfiler();
+
+    // stack: a hash of the frames and their call sites, used: the heap slots in use after it
+    void allocated(Site site, addr_t count, u8 stack, addr_t used);
+    // the allocation that overflowed the heap or its limit
+    void failed(Site site, addr_t count);
+
+    // the sites by slots allocated and the sizes by powers of two.
+    // heapUsed: the slots in use at the end, the high-water mark as nothing is ever freed
+    void report(const Program& program, addr_t heapUsed, std::ostream& out) const;
+
+private:
+    struct SiteStats {
+        u8 allocations = 0;
+        u8 slots = 0;
+        addr_t largest = 0;
+        std::set<u8> stacks;
+    };
+    std::map<Site, SiteStats> _sites;
+    // allocations and slots by size, [i] from 2^(i-1) to 2^i - 1 slots, [0] the empty ones
+    std::array<std::pair<u8, u8>, 33> _sizes;
+    u8 _allocations;
+    u8 _slots;
+    // the slots in use before the first new: the string literals and a baked data section
+    std::optional<addr_t> _initial;
+    std::optional<std::pair<Site, addr_t>> _failure;
+};
+
+}
+
+#endif
@@ -14,21 +14,26 @@ struct Instruction {
     u4 y;
 };
 
+// the execution encoding built by the VM at load time.
+// the only two-operand opcode, loada, keeps its operands out of line
+// and x is the index of the pair in VM::_wideOperands.
+struct PackedInstruction {
+    OpCode op;
+    u4 x;
+};
+static_assert(sizeof(PackedInstruction) == 8);
+
 }
 
 template <>
 inline void print(std::ostream& out, const vm::Instruction& t) {
-    const char* name = vm::nameOfOpCode.at(t.op); 
-    if (auto it = vm::paramSizeOfOpCode.find(t.op); it != vm::paramSizeOfOpCode.end()) {
-        switch (it->second.size()) {
-        case 0: print(out, name); break;
-        case 1: print(out, name, t.x); break;
-        case 2: printfmt(out, "{} {},{}", name, t.x, t.y); break;
-        default: print(out, "????"); break;
-        }
-    }
-    else {
-        print(out, name);
+    auto& info = vm::infoOf(t.op);
+    const char* name = info.name != nullptr ? info.name : "????";
+    switch (info.paramCount) {
+    case 0: print(out, name); break;
+    case 1: print(out, name, t.x); break;
+    case 2: printfmt(out, "{} {},{}", name, t.x, t.y); break;
+    default: print(out, "????"); break;
     }
 }
 
@@ -0,0 +1,237 @@
+#include "./io.h"
+#include "./writer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+
+#include <poll.h>
+#include <unistd.h>
+
+namespace vm {
+
+FdOutput::FdOutput(int fd, std::size_t bufferSize)
+    : _fd(fd), _bufferSize(bufferSize), _failed(false) {
+    _buffer.reserve(bufferSize);
+}
+
+FdOutput::~FdOutput() {
+    flush();
+}
+
+void FdOutput::write(const char* data, std::size_t size) {
+    _buffer.append(data, size);
+    if (_buffer.size() >= _bufferSize) {
+        flush();
+    }
+}
+
+void FdOutput::flush() {
+    const char* p = _buffer.data();
+    std::size_t rest = _buffer.size();
+    while (rest > 0 && !_failed) {
+        auto n = ::write(_fd, p, rest);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _failed = true;
+            break;
+        }
+        p += n;
+        rest -= n;
+    }
+    _buffer.clear();
+}
+
+void StreamOutput::write(const char* data, std::size_t size) {
+    _out->write(data, size);
+    _out->flush();
+}
+
+void StreamOutput::flush() {
+    drain_output(*_out);
+}
+
+void StreamOutput::handOver() {
+    hand_over_output(*_out);
+}
+
+FdInput::FdInput(int fd, std::size_t bufferSize) : _fd(fd), _buffer(bufferSize) {}
+
+std::string_view FdInput::next() {
+    while (true) {
+        auto n = ::read(_fd, _buffer.data(), _buffer.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n <= 0 ? std::string_view() : std::string_view(_buffer.data(), n);
+    }
+}
+
+bool FdInput::tryNext(std::string_view& chunk) {
+    while (true) {
+        auto n = ::read(_fd, _buffer.data(), _buffer.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        // a named pipe no writer has opened yet reads as its end, but does not hang up
+        if (n == 0) {
+            pollfd p{_fd, POLLIN, 0};
+            if (::poll(&p, 1, 0) == 0) {
+                return false;
+            }
+        }
+        chunk = n <= 0 ? std::string_view() : std::string_view(_buffer.data(), n);
+        return true;
+    }
+}
+
+std::string_view SpanInput::next() {
+    auto data = _data;
+    _data = std::string_view();
+    return data;
+}
+
+std::string_view StreamInput::next() {
+    if (!std::getline(*_in, _line)) {
+        return std::string_view();
+    }
+    if (!_in->eof()) {
+        _line.push_back('\n');
+    }
+    return _line;
+}
+
+bool InputScanner::refill() {
+    if (_end || _input == nullptr) {
+        return false;
+    }
+    if (_beforeRead) {
+        _beforeRead();
+    }
+    // a token cut by the end of a chunk is already copied to _token
+    _view = _input->next();
+    if (_view.empty()) {
+        _end = true;
+        return false;
+    }
+    return true;
+}
+
+// a value ends at whitespace at the latest, so one followed by whitespace is complete
+bool InputScanner::tokenBuffered() const {
+    auto begin = std::find_if(_view.begin(), _view.end(), [](char c) { return !std::isspace(static_cast<unsigned char>(c)); });
+    return std::find_if(begin, _view.end(), [](char c) { return std::isspace(static_cast<unsigned char>(c)); }) != _view.end();
+}
+
+bool InputScanner::ready() {
+    while (!_end && _input != nullptr && !tokenBuffered()) {
+        if (_beforeRead) {
+            _beforeRead();
+        }
+        // the chunk holding _view is gone after the next read
+        std::string rest(_view);
+        std::string_view chunk;
+        bool available = _input->tryNext(chunk);
+        _carry = std::move(rest);
+        _carry.append(chunk);
+        _view = _carry;
+        if (!available) {
+            return false;
+        }
+        _end = chunk.empty();
+    }
+    return true;
+}
+
+bool InputScanner::skipSpace() {
+    for (int c; (c = peek()) >= 0; _view.remove_prefix(1)) {
+        if (!std::isspace(c)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool InputScanner::scan(int_t& value) {
+    _token.clear();
+    if (!skipSpace()) {
+        return false;
+    }
+    if (int c = peek(); c == '+' || c == '-') {
+        take();
+    }
+    std::size_t digits = 0;
+    for (int c; (c = peek()) >= 0 && std::isdigit(c); ++digits) {
+        take();
+    }
+    if (digits == 0) {
+        return false;
+    }
+    errno = 0;
+    auto v = std::strtoll(_token.c_str(), nullptr, 10);
+    if (errno == ERANGE || v < INT_MIN || v > INT_MAX) {
+        return false;
+    }
+    value = static_cast<int_t>(v);
+    return true;
+}
+
+bool InputScanner::scan(double_t& value) {
+    _token.clear();
+    if (!skipSpace()) {
+        return false;
+    }
+    if (int c = peek(); c == '+' || c == '-') {
+        take();
+    }
+    bool mantissa = false;
+    bool point = false;
+    int c;
+    for (; (c = peek()) >= 0; take()) {
+        if (std::isdigit(c)) {
+            mantissa = true;
+        }
+        else if (c == '.' && !point) {
+            point = true;
+        }
+        else {
+            break;
+        }
+    }
+    if (mantissa && (c == 'e' || c == 'E')) {
+        take();
+        if (c = peek(); c == '+' || c == '-') {
+            take();
+        }
+        while ((c = peek()) >= 0 && std::isdigit(c)) {
+            take();
+        }
+    }
+    char* end;
+    auto v = std::strtod(_token.c_str(), &end);
+    // like std::num_get, the whole token must be a number and an overflow fails
+    if (end == _token.c_str() || *end != '\0' || std::isinf(v)) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+bool InputScanner::scan(char_t& value) {
+    if (!skipSpace()) {
+        return false;
+    }
+    value = static_cast<char_t>(peek());
+    _view.remove_prefix(1);
+    return true;
+}
+
+}
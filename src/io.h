@@ -0,0 +1,163 @@
+#ifndef IO_H_INCLUDED
+#define IO_H_INCLUDED
+
+#include "./type.h"
+
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace vm {
+
+// where a VM writes its output.
+// the VM formats into a buffer of its own and hands over whole lines,
+// or the buffer when it is full, never single values
+class Output {
+public:
+    virtual ~Output() = default;
+    virtual void write(const char* data, std::size_t size) = 0;
+    // everything written so far must become visible,
+    // called before diagnostics and at the end of a run
+    virtual void flush() {}
+    // everything written so far must be on its way without waiting for it to arrive,
+    // called before blocking on input
+    virtual void handOver() { flush(); }
+};
+
+// where a VM reads its input from
+class Input {
+public:
+    virtual ~Input() = default;
+    // the next chunk of input, empty at the end.
+    // the chunk stays valid until the next call
+    virtual std::string_view next() = 0;
+    // like next(), but false instead of waiting when nothing is available yet
+    virtual bool tryNext(std::string_view& chunk) {
+        chunk = next();
+        return true;
+    }
+};
+
+// buffered writes to a file descriptor, only flush() and a full buffer write
+class FdOutput : public Output {
+public:
+    explicit FdOutput(int fd, std::size_t bufferSize = 1 << 16);
+    virtual ~FdOutput();
+    virtual void write(const char* data, std::size_t size) override;
+    virtual void flush() override;
+    bool failed() const { return _failed; }
+
+private:
+    int _fd;
+    std::size_t _bufferSize;
+    std::string _buffer;
+    bool _failed;
+};
+
+// collects the output in memory
+class BufferOutput : public Output {
+public:
+    virtual void write(const char* data, std::size_t size) override { _data.append(data, size); }
+    const std::string& str() const { return _data; }
+    void clear() { _data.clear(); }
+
+private:
+    std::string _data;
+};
+
+// writes to a std::ostream and flushes it after every line, as std::endl would
+class StreamOutput : public Output {
+public:
+    explicit StreamOutput(std::ostream& out) : _out(&out) {}
+    virtual void write(const char* data, std::size_t size) override;
+    virtual void flush() override;
+    virtual void handOver() override;
+
+private:
+    std::ostream* _out;
+};
+
+// reads from a file descriptor as much as is available.
+// on a non-blocking one, tryNext() tells an empty pipe from its end
+class FdInput : public Input {
+public:
+    explicit FdInput(int fd, std::size_t bufferSize = 1 << 16);
+    virtual std::string_view next() override;
+    virtual bool tryNext(std::string_view& chunk) override;
+
+private:
+    int _fd;
+    std::vector<char> _buffer;
+};
+
+// input already in memory, e.g. a mapped file, is handed over as one chunk without copying
+class SpanInput : public Input {
+public:
+    explicit SpanInput(std::string_view data) : _data(data) {}
+    virtual std::string_view next() override;
+
+private:
+    std::string_view _data;
+};
+
+// reads a std::istream line by line, so an interactive input is not waited for
+class StreamInput : public Input {
+public:
+    explicit StreamInput(std::istream& in) : _in(&in) {}
+    virtual std::string_view next() override;
+
+private:
+    std::istream* _in;
+    std::string _line;
+};
+
+// reads values the way operator>> of std::istream does:
+// skips whitespace, then takes the longest prefix that can be part of the value,
+// the rest is left to the next read
+class InputScanner {
+public:
+    InputScanner() = default;
+    explicit InputScanner(Input& input) : _input(&input) {}
+
+    // called before every read of a new chunk, which may block
+    void setBeforeRead(std::function<void()> fn) { _beforeRead = std::move(fn); }
+
+    bool scan(int_t& value);
+    bool scan(double_t& value);
+    bool scan(char_t& value);
+    // true when the next scan can finish with the input at hand, whatever it scans.
+    // otherwise reads what is available without waiting, for a run that must not block
+    bool ready();
+
+private:
+    int peek() {
+        if (_view.empty() && !refill()) {
+            return -1;
+        }
+        return static_cast<unsigned char>(_view.front());
+    }
+    void take() {
+        _token.push_back(_view.front());
+        _view.remove_prefix(1);
+    }
+    bool refill();
+    bool skipSpace();
+    bool tokenBuffered() const;
+
+private:
+    Input* _input = nullptr;
+    std::function<void()> _beforeRead;
+    std::string_view _view;
+    bool _end = false;
+    std::string _token;
+    // what ready() has read, when a token is cut by the end of a chunk
+    std::string _carry;
+};
+
+}
+
+#endif
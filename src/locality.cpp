@@ -0,0 +1,182 @@
+#include "./locality.h"
+#include "./util/print.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <utility>
+
+namespace vm {
+
+// 64 and 4096 bytes of 4-byte slots
+const addr_t LocalityProfiler::LINE_SLOTS = 16;
+const addr_t LocalityProfiler::PAGE_SLOTS = 1024;
+const std::size_t LocalityProfiler::REPORTED_BLOCKS = 20;
+const std::size_t LocalityProfiler::MAX_STRIDES = 64;
+
+namespace {
+
+std::size_t bucketOf(std::size_t distance) {
+    std::size_t bucket = 0;
+    for (; distance != 0; distance >>= 1) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+std::string rangeOf(std::size_t bucket) {
+    if (bucket <= 1) {
+        return std::to_string(bucket);
+    }
+    return std::to_string(u8(1) << (bucket - 1)) + "-" + std::to_string((u8(1) << bucket) - 1);
+}
+
+double percentOf(u8 count, u8 total) {
+    return total == 0 ? 0 : 100.0 * count / total;
+}
+
+}
+
+void LocalityProfiler::ReuseDistance::touch(addr_t addr) {
+    if (_now + 1 >= _tree.size()) {
+        compact();
+    }
+    ++_now;
+    auto key = addr / _granule;
+    auto it = _last.find(key);
+    if (it == _last.end()) {
+        ++_histogram.back();
+        _last.emplace(key, _now);
+    }
+    else {
+        // the keys touched later are marked after its last touch
+        auto distance = _last.size() - marksUpTo(it->second);
+        ++_histogram[bucketOf(distance)];
+        mark(it->second, -1);
+        it->second = _now;
+    }
+    mark(_now, 1);
+}
+
+void LocalityProfiler::ReuseDistance::mark(std::size_t time, int delta) {
+    for (; time < _tree.size(); time += time & (~time + 1)) {
+        _tree[time] += delta;
+    }
+}
+
+std::size_t LocalityProfiler::ReuseDistance::marksUpTo(std::size_t time) const {
+    std::size_t count = 0;
+    for (; time > 0; time -= time & (~time + 1)) {
+        count += _tree[time];
+    }
+    return count;
+}
+
+void LocalityProfiler::ReuseDistance::compact() {
+    std::vector<std::pair<std::size_t, addr_t>> order;
+    order.reserve(_last.size());
+    for (auto& [key, time] : _last) {
+        order.emplace_back(time, key);
+    }
+    std::sort(order.begin(), order.end());
+    _tree.assign(std::max<std::size_t>(1024, 2 * order.size() + 2), 0);
+    _now = 0;
+    for (auto& [time, key] : order) {
+        _last[key] = ++_now;
+        mark(_now, 1);
+    }
+}
+
+LocalityProfiler::LocalityProfiler()
+    : _local(0), _outer(0), _heap(0), _lines(LINE_SLOTS), _pages(PAGE_SLOTS) {
+}
+
+void LocalityProfiler::stack(addr_t addr, bool local) {
+    ++(local ? _local : _outer);
+    touch(addr);
+}
+
+void LocalityProfiler::heap(addr_t addr, std::size_t block, addr_t start, addr_t size) {
+    ++_heap;
+    touch(addr);
+    auto& b = _blocks[block];
+    if (b.accesses == 0) {
+        b.start = start;
+        b.size = size;
+    }
+    else if (auto stride = addr - b.last; b.strides.size() < MAX_STRIDES || b.strides.count(stride) != 0) {
+        ++b.strides[stride];
+    }
+    else {
+        ++b.otherStrides;
+    }
+    ++b.accesses;
+    b.last = addr;
+}
+
+void LocalityProfiler::touch(addr_t addr) {
+    _lines.touch(addr);
+    _pages.touch(addr);
+}
+
+void LocalityProfiler::report(std::ostream& out) const {
+    auto total = _local + _outer + _heap;
+    println(out, total, "memory accesses");
+    out << std::fixed << std::setprecision(2);
+    out << std::left << std::setw(24) << "stack, current frame" << std::right << std::setw(16) << _local
+        << std::setw(9) << percentOf(_local, total) << '\n';
+    out << std::left << std::setw(24) << "stack, outer frames" << std::right << std::setw(16) << _outer
+        << std::setw(9) << percentOf(_outer, total) << '\n';
+    out << std::left << std::setw(24) << "heap" << std::right << std::setw(16) << _heap
+        << std::setw(9) << percentOf(_heap, total) << '\n';
+
+    // the distance counts the other lines or pages touched in between, 0 is a touch of the same again
+    auto& lines = _lines.histogram();
+    auto& pages = _pages.histogram();
+    out << '\n' << std::left << std::setw(24) << "reuse distance" << std::right
+        << std::setw(16) << "lines (64 B)" << std::setw(9) << "%"
+        << std::setw(16) << "pages (4 KiB)" << std::setw(9) << "%" << '\n';
+    for (std::size_t bucket = 0; bucket < lines.size(); ++bucket) {
+        if (lines[bucket] == 0 && pages[bucket] == 0) {
+            continue;
+        }
+        out << std::left << std::setw(24) << (bucket + 1 == lines.size() ? "first touch" : rangeOf(bucket))
+            << std::right << std::setw(16) << lines[bucket] << std::setw(9) << percentOf(lines[bucket], total)
+            << std::setw(16) << pages[bucket] << std::setw(9) << percentOf(pages[bucket], total) << '\n';
+    }
+
+    std::vector<const Block*> blocks;
+    for (auto& [index, block] : _blocks) {
+        blocks.push_back(&block);
+    }
+    auto shown = std::min(blocks.size(), REPORTED_BLOCKS);
+    std::partial_sort(blocks.begin(), blocks.begin() + shown, blocks.end(), [](auto a, auto b) {
+        return a->accesses != b->accesses ? a->accesses > b->accesses : a->start < b->start;
+    });
+    out << '\n' << std::left << std::setw(24) << "heap block" << std::right << std::setw(12) << "slots"
+        << std::setw(16) << "accesses" << std::setw(9) << "%" << "   strides" << '\n';
+    for (std::size_t i = 0; i < shown; ++i) {
+        auto& block = *blocks[i];
+        out << std::left << std::setw(24) << block.start << std::right << std::setw(12) << block.size
+            << std::setw(16) << block.accesses << std::setw(9) << percentOf(block.accesses, _heap) << "  ";
+        // the commonest strides, in slots
+        std::vector<std::pair<u8, addr_t>> strides;
+        for (auto [stride, count] : block.strides) {
+            strides.emplace_back(count, stride);
+        }
+        std::sort(strides.begin(), strides.end(), [](auto& a, auto& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        auto steps = block.accesses - 1;
+        for (std::size_t k = 0; k < strides.size() && k < 4; ++k) {
+            out << ' ' << strides[k].second << ':' << percentOf(strides[k].first, steps) << '%';
+        }
+        if (block.otherStrides != 0) {
+            out << " other:" << percentOf(block.otherStrides, steps) << '%';
+        }
+        out << '\n';
+    }
+    out << std::defaultfloat << std::setprecision(6);
+}
+
+}
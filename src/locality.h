@@ -0,0 +1,83 @@
+#ifndef LOCALITY_H_INCLUDED
+#define LOCALITY_H_INCLUDED
+
+#include "./type.h"
+
+#include <array>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace vm {
+
+// how a run touches memory, for --locality: every address that passes VM::checkAddr,
+// by where it lies, by heap block with the strides between its accesses,
+// and how many other cache lines and pages were touched before one is touched again
+class LocalityProfiler {
+public:
+    // a cache line and a page in slots
+    static const addr_t LINE_SLOTS;
+    static const addr_t PAGE_SLOTS;
+    // the heap blocks listed by the report
+    static const std::size_t REPORTED_BLOCKS;
+
+    LocalityProfiler();
+
+    // local: in the frame of the function running, or its arguments
+    void stack(addr_t addr, bool local);
+    // block: the index of the allocation in the heap record, which starts at start
+    void heap(addr_t addr, std::size_t block, addr_t start, addr_t size);
+
+    void report(std::ostream& out) const;
+
+private:
+    // the reuse distances by powers of two: [0] for none, [i] from 2^(i-1) to 2^i - 1,
+    // and the last for the first touch
+    using Histogram = std::array<u8, 34>;
+
+    // the distinct keys touched since each key was last touched, an LRU stack in a Fenwick tree
+    // over the times of the latest touch of every key
+    class ReuseDistance {
+    public:
+        explicit ReuseDistance(addr_t granule) : _granule(granule), _now(0), _histogram{} {}
+        void touch(addr_t addr);
+        const Histogram& histogram() const { return _histogram; }
+    private:
+        void mark(std::size_t time, int delta);
+        std::size_t marksUpTo(std::size_t time) const;
+        // numbers the latest touches from 1 again, so the tree grows with the keys and not with time
+        void compact();
+        addr_t _granule;
+        std::unordered_map<addr_t, std::size_t> _last;
+        // counts 1 at the time of the latest touch of every key, indexed from 1
+        std::vector<int> _tree;
+        std::size_t _now;
+        Histogram _histogram;
+    };
+
+    struct Block {
+        addr_t start;
+        addr_t size;
+        u8 accesses = 0;
+        addr_t last = 0;
+        // the first MAX_STRIDES different strides, the others are only counted
+        std::map<addr_t, u8> strides;
+        u8 otherStrides = 0;
+    };
+    static const std::size_t MAX_STRIDES;
+
+    void touch(addr_t addr);
+
+    u8 _local;
+    u8 _outer;
+    u8 _heap;
+    std::unordered_map<std::size_t, Block> _blocks;
+    ReuseDistance _lines;
+    ReuseDistance _pages;
+};
+
+}
+
+#endif
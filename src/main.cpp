@@ -1,6 +1,16 @@
 #include "./vm.h"
 #include "./file.h"
 #include "./exception.h"
+#include "./writer.h"
+#include "./cache.h"
+#include "./batch.h"
+#include "./server.h"
+#include "./forkserver.h"
+#include "./profiler.h"
+#include "./sampler.h"
+#include "./tracer.h"
+#include "./heap_profiler.h"
+#include "./locality.h"
 #include "./util/print.hpp"
 #include "argparse.hpp"
 
@@ -9,10 +19,20 @@
 #include <memory>
 #include <string>
 #include <exception>
+#include <chrono>
+#include <algorithm>
+#include <optional>
+#include <iterator>
+#include <utility>
+#include <unistd.h>
 
-void disassemble_binary(std::ifstream* in, std::ostream* out) {
+void disassemble_binary(const std::string& in, std::ostream* out) {
     try {
-        File f = File::parse_file_binary(*in);
+        File f = File::parse_file_binary(in);
+        // the text format has no data section, the listing would assemble to a program without its globals
+        if (f.data) {
+            throw InvalidFile("cannot disassemble a binary whose .start is baked");
+        }
         f.output_text(*out);
     }
     catch (const std::exception& e) {
@@ -20,13 +40,21 @@ void disassemble_binary(std::ifstream* in, std::ostream* out) {
     }
 }
 
-void assemble_text(std::ifstream* in, std::ofstream* out, bool run = false) {
+void assemble_text(std::ifstream* in, std::ofstream* out, bool run = false, bool bake = false) {
     try {
         File f = File::parse_file_text(*in);
+        if (bake) {
+            try {
+                vm::VM::bakeStart(f);
+            }
+            catch (const std::exception& e) {
+                println(std::cerr, ".start is not baked:", e.what());
+            }
+        }
         // f.output_text(std::cout);
         f.output_binary(*out);
         if (run) {
-            auto avm = std::move(vm::VM::make_vm(f));
+            auto avm = vm::VM::make_vm(std::make_shared<const vm::Program>(std::move(f)));
             avm->start();
         }
     }
@@ -35,15 +63,234 @@ void assemble_text(std::ifstream* in, std::ofstream* out, bool run = false) {
     }
 }
 
-void execute(std::ifstream* in, std::ostream* out) {
+// the exit code of -r when the run exceeds a limit
+const int LIMIT_EXIT_CODE = 3;
+
+struct ExecuteOptions {
+    bool async = false;
+    bool lazy = false;
+    bool stats = false;
+    std::string cacheDir;
+    std::string checkpointPath;
+    std::optional<std::pair<int, vm::addr_t>> checkpointMark;
+    std::string restorePath;
+    bool forkServer = false;
+    bool bake = false;
+    bool guardPage = false;
+    vm::VM::Limits limits;
+    // where -p writes the profile
+    std::ostream* profile = nullptr;
+    // where --sample writes the folded stacks
+    std::string samplePath;
+    std::chrono::microseconds sampleInterval{1000};
+    // where --trace writes the events
+    std::string tracePath;
+    std::size_t traceDepth = 0;
+    vm::u4 traceEvery = 1;
+    // where --heap-profile writes the allocations
+    std::string heapProfilePath;
+    // where --locality writes the memory accesses
+    std::string localityPath;
+};
+
+// "F:I" names instruction I of function F, F being a function index or "start"
+std::optional<std::pair<int, vm::addr_t>> parse_checkpoint_mark(const std::string& s) {
+    auto colon = s.find(':');
+    if (colon == std::string::npos) {
+        return std::nullopt;
+    }
+    try {
+        auto function = s.substr(0, colon);
+        int index = function == "start" ? -1 : std::stoi(function);
+        return std::make_pair(index, static_cast<vm::addr_t>(std::stoi(s.substr(colon + 1))));
+    }
+    catch (const std::exception&) {
+        return std::nullopt;
+    }
+}
+
+// the limits of --max-*, none if one of them is not a number
+std::optional<vm::VM::Limits> parse_limits(argparse::ArgumentParser& program) {
+    vm::VM::Limits limits;
+    try {
+        if (auto s = program.get<std::string>("--max-instructions"); !s.empty()) {
+            limits.instructions = std::stoull(s);
+        }
+        if (auto s = program.get<std::string>("--max-seconds"); !s.empty()) {
+            limits.seconds = std::stod(s);
+        }
+        if (auto s = program.get<std::string>("--max-depth"); !s.empty()) {
+            limits.callDepth = std::stoull(s);
+        }
+        if (auto s = program.get<std::string>("--max-heap"); !s.empty()) {
+            limits.heapSlots = static_cast<vm::addr_t>(std::min<unsigned long long>(std::stoull(s), INT32_MAX));
+        }
+    }
+    catch (const std::exception&) {
+        return std::nullopt;
+    }
+    return limits;
+}
+
+// the exit code
+int run_vm(vm::VM& avm, const ExecuteOptions& options) {
+    avm.setLimits(options.limits);
+    if (options.guardPage) {
+        avm.useGuardPage();
+    }
+    if (!options.checkpointPath.empty()) {
+        avm.setCheckpoint(options.checkpointPath, options.checkpointMark);
+        vm::VM::enableCheckpointSignal();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    if (options.restorePath.empty()) {
+        avm.start();
+    }
+    else {
+        avm.resume(options.restorePath);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    if (options.lazy) {
+        avm.printLoadStats(std::cerr);
+    }
+    if (options.stats) {
+        auto count = avm.executedInstructions();
+        println(std::cerr, "executed", count, "instructions in", elapsed.count(), "s,", 
+            static_cast<vm::u8>(count / std::max(elapsed.count(), 1e-9)), "instructions/s");
+    }
+    return avm.limitExceeded() ? LIMIT_EXIT_CODE : 0;
+}
+
+int execute(const std::string& in, std::ostream* out, const ExecuteOptions& options) {
     try {
-        File f = File::parse_file_binary(*in);
-        auto avm = std::move(vm::VM::make_vm(f));
-        avm->start();
+        // the cache holds programs ready to run, baking and the listing of -p need the file
+        std::shared_ptr<const vm::Program> cached;
+        if (!options.cacheDir.empty() && !options.bake && options.profile == nullptr) {
+            ProgramCache cache(options.cacheDir);
+            cached = cache.load(in);
+            if (options.stats) {
+                println(std::cerr, "program cache", cache.hit() ? "hit" : "miss");
+            }
+        }
+        File f{0, {}, {}, {}};
+        if (cached == nullptr) {
+            f = File::parse_file_binary(in, options.lazy);
+        }
+        if (options.forkServer) {
+            if (options.bake) {
+                try {
+                    vm::VM::bakeStart(f);
+                }
+                catch (const std::exception& e) {
+                    println(std::cerr, ".start is not baked:", e.what());
+                }
+            }
+            if (!run_fork_server(cached != nullptr ? cached : std::make_shared<const vm::Program>(std::move(f)),
+                                 options.limits)) {
+                println(std::cerr, "no fork server control pipe on fd 198 and 199");
+                exit(2);
+            }
+            return 0;
+        }
+        // the annotated disassembly of -p is made from the file as loaded
+        std::optional<File> listing;
+        if (options.profile != nullptr) {
+            listing = f;
+        }
+        auto program = cached != nullptr ? cached : std::make_shared<const vm::Program>(std::move(f));
+        std::optional<vm::Profiler> profiler;
+        if (options.profile != nullptr) {
+            profiler.emplace(program->functions().size());
+        }
+        std::optional<vm::Sampler> sampler;
+        if (!options.samplePath.empty()) {
+            sampler.emplace(options.sampleInterval);
+        }
+        std::optional<vm::Tracer> tracer;
+        if (!options.tracePath.empty()) {
+            tracer.emplace(options.traceDepth, options.traceEvery);
+        }
+        std::optional<vm::HeapProfiler> heapProfiler;
+        if (!options.heapProfilePath.empty()) {
+            heapProfiler.emplace();
+        }
+        std::optional<vm::LocalityProfiler> locality;
+        if (!options.localityPath.empty()) {
+            locality.emplace();
+        }
+        vm::addr_t heapUsed = 0;
+        const auto observed = [&](vm::VM& avm) {
+            avm.setProfiler(profiler ? &*profiler : nullptr);
+            avm.setTracer(tracer ? &*tracer : nullptr);
+            avm.setHeapProfiler(heapProfiler ? &*heapProfiler : nullptr);
+            avm.setLocalityProfiler(locality ? &*locality : nullptr);
+            if (sampler) {
+                sampler->start(avm);
+            }
+            int code = run_vm(avm, options);
+            if (sampler) {
+                sampler->stop();
+            }
+            heapUsed = avm.heapUsed();
+            return code;
+        };
+        int code;
+        if (options.async) {
+            std::cout.flush();
+            vm::AsyncWriter writer(STDOUT_FILENO);
+            std::ostream aout(&writer);
+            auto avm = vm::VM::make_vm(program, aout);
+            code = observed(*avm);
+            writer.drain();
+        }
+        else {
+            auto avm = vm::VM::make_vm(program);
+            code = observed(*avm);
+        }
+        if (profiler) {
+            profiler->report(*program, *options.profile);
+            listing->output_text(*options.profile, &profiler->lines());
+        }
+        if (sampler) {
+            std::ofstream folded(options.samplePath, std::ios::out | std::ios::trunc);
+            sampler->writeFolded(*program, folded);
+            if (!folded) {
+                println(std::cerr, "cannot write", options.samplePath);
+            }
+            if (options.stats) {
+                println(std::cerr, sampler->samples(), "samples,", sampler->dropped(), "dropped");
+            }
+        }
+        if (heapProfiler) {
+            std::ofstream report(options.heapProfilePath, std::ios::out | std::ios::trunc);
+            heapProfiler->report(*program, heapUsed, report);
+            if (!report) {
+                println(std::cerr, "cannot write", options.heapProfilePath);
+            }
+        }
+        if (locality) {
+            std::ofstream report(options.localityPath, std::ios::out | std::ios::trunc);
+            locality->report(report);
+            if (!report) {
+                println(std::cerr, "cannot write", options.localityPath);
+            }
+        }
+        if (tracer) {
+            std::ofstream json(options.tracePath, std::ios::out | std::ios::trunc);
+            tracer->writeJson(*program, json);
+            if (!json) {
+                println(std::cerr, "cannot write", options.tracePath);
+            }
+            if (options.stats) {
+                println(std::cerr, tracer->events(), "events,", tracer->overwritten(), "overwritten");
+            }
+        }
+        return code;
     }
     catch (const std::exception& e) {
         println(std::cerr, e.what());
     }
+    return 0;
 }
 
 int main (int argc, char** argv) {
@@ -63,6 +310,97 @@ int main (int argc, char** argv) {
 		.default_value(false)
 		.implicit_value(true)
 		.help("interpret the binary input file.");
+    program.add_argument("-p")
+		.default_value(false)
+		.implicit_value(true)
+		.help("interpret the binary input file and write the instruction counts and an annotated disassembly to output.");
+    program.add_argument("-b")
+		.default_value(false)
+		.implicit_value(true)
+		.help("run the cases listed in the input manifest and report them as JSON lines.");
+    program.add_argument("--jobs")
+		.default_value(std::string(""))
+		.help("the number of threads of -b, all cores by default.");
+    program.add_argument("--interleave")
+		.default_value(false)
+		.implicit_value(true)
+		.help("let the cases of -b on a thread take turns, so a case waiting for input does not hold up the others.");
+    program.add_argument("--serve")
+		.default_value(false)
+		.implicit_value(true)
+		.help("run as a daemon on the Unix socket named by input, keeping programs and VMs between requests.");
+    program.add_argument("--connect")
+		.default_value(std::string(""))
+		.help("run the binary input file through the daemon on this socket, with the standard input.");
+    program.add_argument("--bake-start")
+		.default_value(false)
+		.implicit_value(true)
+		.help("run .start when assembling with -a and store the globals it leaves in the binary, or once before forking with --fork-server.");
+    program.add_argument("--fork-server")
+		.default_value(false)
+		.implicit_value(true)
+		.help("serve -r as an AFL fork server, forking every test from the prepared VM.");
+    program.add_argument("--async-output")
+		.default_value(false)
+		.implicit_value(true)
+		.help("write the output of -r on a background thread.");
+    program.add_argument("--lazy")
+		.default_value(false)
+		.implicit_value(true)
+		.help("decode each function of -r on its first call.");
+    program.add_argument("--stats")
+		.default_value(false)
+		.implicit_value(true)
+		.help("report the executed instructions and the speed of -r.");
+    program.add_argument("--guard-page")
+		.default_value(false)
+		.implicit_value(true)
+		.help("catch stack overflows of -r with a guard page instead of checking every push.");
+    program.add_argument("--sample")
+		.default_value(std::string(""))
+		.help("sample the functions of -r on a CPU timer and write the stacks to this file in the folded format of flame graphs.");
+    program.add_argument("--sample-interval")
+		.default_value(std::string(""))
+		.help("microseconds of CPU time between two samples of --sample, 1000 by default.");
+    program.add_argument("--trace")
+		.default_value(std::string(""))
+		.help("write the calls, returns and I/O of -r with their times to this file as Chrome trace_event JSON.");
+    program.add_argument("--trace-depth")
+		.default_value(std::string(""))
+		.help("leave out of --trace the calls nested deeper than this.");
+    program.add_argument("--trace-every")
+		.default_value(std::string(""))
+		.help("trace one call in this many with all it calls, the others are left out of --trace.");
+    program.add_argument("--heap-profile")
+		.default_value(std::string(""))
+		.help("write the heap allocations of -r by site and by size, and the heap high-water mark, to this file.");
+    program.add_argument("--locality")
+		.default_value(std::string(""))
+		.help("write the stack and heap accesses of -r, the strides within each heap block and the reuse distances of cache lines and pages to this file.");
+    program.add_argument("--cache")
+		.default_value(std::string(""))
+		.help("keep the decoded programs of -r in this directory.");
+    program.add_argument("--checkpoint")
+		.default_value(std::string(""))
+		.help("snapshot the state of -r to this file on SIGUSR1 or at --checkpoint-at.");
+    program.add_argument("--checkpoint-at")
+		.default_value(std::string(""))
+		.help("take the snapshot before instruction I of function F, written as F:I (F is an index or start).");
+    program.add_argument("--restore")
+		.default_value(std::string(""))
+		.help("continue -r from a snapshot file.");
+    program.add_argument("--max-instructions")
+		.default_value(std::string(""))
+		.help("stop -r, the cases of -b and the runs of --serve after about this many instructions.");
+    program.add_argument("--max-seconds")
+		.default_value(std::string(""))
+		.help("stop -r, the cases of -b and the runs of --serve after about this many seconds of wall time.");
+    program.add_argument("--max-depth")
+		.default_value(std::string(""))
+		.help("stop -r, the cases of -b and the runs of --serve when the calls nest deeper than this.");
+    program.add_argument("--max-heap")
+		.default_value(std::string(""))
+		.help("stop -r, the cases of -b and the runs of --serve when the heap would grow beyond this many slots.");
     program.add_argument("output")
 		.default_value(std::string("-"))
         .required()
@@ -109,7 +447,7 @@ int main (int argc, char** argv) {
         else {
             output = &std::cout;
         }
-        disassemble_binary(input, output);
+        disassemble_binary(input_file, output);
     }
     else if (program["-a"] == true) {
         if (program["-d"] == true) {
@@ -131,9 +469,10 @@ int main (int argc, char** argv) {
             exit(2);
         }
         output = &outf;
-        assemble_text(input, dynamic_cast<std::ofstream*>(output), program["-r"] == true);
+        assemble_text(input, dynamic_cast<std::ofstream*>(output), program["-r"] == true,
+            program["--bake-start"] == true);
     }
-    else if (program["-r"] == true) {
+    else if (program["-r"] == true || program["-p"] == true) {
         inf.open(input_file, std::ios::binary | std::ios::in);
         if (!inf) {
             exit(2);
@@ -151,11 +490,148 @@ int main (int argc, char** argv) {
             }
             output = &outf;
         }
+        else {
+            // the program of -p has the standard output
+            output = program["-p"] == true ? &std::cerr : &std::cout;
+        }
+
+        ExecuteOptions options;
+        options.async = program["--async-output"] == true;
+        options.lazy = program["--lazy"] == true;
+        options.stats = program["--stats"] == true;
+        options.cacheDir = program.get<std::string>("--cache");
+        options.checkpointPath = program.get<std::string>("--checkpoint");
+        options.restorePath = program.get<std::string>("--restore");
+        options.forkServer = program["--fork-server"] == true;
+        options.bake = program["--bake-start"] == true;
+        options.guardPage = program["--guard-page"] == true;
+        if (program["-p"] == true) {
+            options.profile = output;
+        }
+        options.samplePath = program.get<std::string>("--sample");
+        options.tracePath = program.get<std::string>("--trace");
+        options.heapProfilePath = program.get<std::string>("--heap-profile");
+        options.localityPath = program.get<std::string>("--locality");
+        try {
+            if (auto interval = program.get<std::string>("--sample-interval"); !interval.empty()) {
+                options.sampleInterval = std::chrono::microseconds(std::max(std::stoll(interval), 1LL));
+            }
+            if (auto depth = program.get<std::string>("--trace-depth"); !depth.empty()) {
+                options.traceDepth = std::stoull(depth);
+            }
+            if (auto every = program.get<std::string>("--trace-every"); !every.empty()) {
+                options.traceEvery = static_cast<vm::u4>(std::max(std::stoll(every), 1LL));
+            }
+        }
+        catch (const std::exception&) {
+            std::cout << program;
+            exit(2);
+        }
+        if (auto mark = program.get<std::string>("--checkpoint-at"); !mark.empty()) {
+            options.checkpointMark = parse_checkpoint_mark(mark);
+            if (!options.checkpointMark || options.checkpointPath.empty()) {
+                std::cout << program;
+                exit(2);
+            }
+        }
+        if (auto limits = parse_limits(program)) {
+            options.limits = *limits;
+        }
+        else {
+            std::cout << program;
+            exit(2);
+        }
+        if (int code = execute(input_file, output, options); code != 0) {
+            outf.close();
+            return code;
+        }
+    }
+    else if (program["--serve"] == true) {
+        unsigned threads = default_thread_count();
+        if (auto jobs = program.get<std::string>("--jobs"); !jobs.empty()) {
+            try {
+                threads = static_cast<unsigned>(std::max(std::stoi(jobs), 1));
+            }
+            catch (const std::exception&) {
+                std::cout << program;
+                exit(2);
+            }
+        }
+        auto limits = parse_limits(program);
+        if (!limits) {
+            std::cout << program;
+            exit(2);
+        }
+        try {
+            serve(input_file, threads, *limits);
+        }
+        catch (const std::exception& e) {
+            println(std::cerr, e.what());
+            exit(2);
+        }
+    }
+    else if (auto socket = program.get<std::string>("--connect"); !socket.empty()) {
+        if (output_file != "-") {
+            outf.open(output_file, std::ios::out | std::ios::trunc);
+            if (!outf) {
+                exit(2);
+            }
+            output = &outf;
+        }
+        else {
+            output = &std::cout;
+        }
+        std::string stdinText(std::istreambuf_iterator<char>(std::cin), {});
+        try {
+            auto status = request(socket, input_file, stdinText, *output, std::cerr, program["--stats"] == true);
+            outf.close();
+            return static_cast<int>(status);
+        }
+        catch (const std::exception& e) {
+            println(std::cerr, e.what());
+            exit(2);
+        }
+    }
+    else if (program["-b"] == true) {
+        if (output_file != "-") {
+            if (input_file == output_file) {
+                output_file += ".out";
+            }
+            outf.open(output_file, std::ios::out | std::ios::trunc);
+            if (!outf) {
+                exit(2);
+            }
+            output = &outf;
+        }
         else {
             output = &std::cout;
         }
 
-        execute(input, output);
+        unsigned threads = default_thread_count();
+        if (auto jobs = program.get<std::string>("--jobs"); !jobs.empty()) {
+            try {
+                threads = static_cast<unsigned>(std::max(std::stoi(jobs), 1));
+            }
+            catch (const std::exception&) {
+                std::cout << program;
+                exit(2);
+            }
+        }
+        try {
+            auto limits = parse_limits(program);
+            if (!limits) {
+                std::cout << program;
+                exit(2);
+            }
+            if (run_batch(read_manifest(input_file), *output, threads, program["--interleave"] == true, *limits) != 0) {
+                outf.close();
+                return 1;
+            }
+        }
+        catch (const std::exception& e) {
+            println(std::cerr, e.what());
+            exit(2);
+        }
     }
     else {
         exit(2);
@@ -3,8 +3,9 @@
 
 #include "./type.h"
 
-#include <vector>
-#include <unordered_map>
+#include <array>
+#include <cstddef>
+#include <string_view>
 
 namespace vm {
 
@@ -127,95 +128,141 @@ enum class OpCode : u1 {
     // ...
     // ..., value
     iscan = 0xb0, dscan = 0xb1, cscan = 0xb2,
-};
 
-#define NAME(op) { OpCode::op, #op }
-const std::unordered_map<OpCode, const char*> nameOfOpCode = {
-    NAME(nop),
-
-    NAME(bipush), NAME(ipush),
-    NAME(pop),    NAME(pop2), NAME(popn),
-    NAME(dup),    NAME(dup2),
-    NAME(loadc),  NAME(loada),
-    {OpCode::_new, "new"},
-    NAME(snew),
-        
-    NAME(iload),   NAME(dload),   NAME(aload),
-    NAME(iaload),  NAME(daload),  NAME(aaload),
-    NAME(istore),  NAME(dstore),  NAME(astore),
-    NAME(iastore), NAME(dastore), NAME(aastore),
-        
-    NAME(iadd), NAME(dadd),
-    NAME(isub), NAME(dsub),
-    NAME(imul), NAME(dmul),
-    NAME(idiv), NAME(ddiv),
-    NAME(ineg), NAME(dneg),
-    NAME(icmp), NAME(dcmp),
-        
-    NAME(i2d), NAME(d2i), NAME(i2c),
-        
-    NAME(jmp),
-    NAME(je), NAME(jne), NAME(jl), NAME(jge), NAME(jg), NAME(jle),
-
-    NAME(call),
-    NAME(ret),
-    NAME(iret), NAME(dret), NAME(aret),
-
-    NAME(iprint), NAME(dprint), NAME(cprint), NAME(sprint),
-    NAME(printl),
-    NAME(iscan),  NAME(dscan),  NAME(cscan),
+    // one-shot trap planted in the packed code by the VM, never valid in a file
+    _trap = 0xff,
 };
-#undef NAME
 
-const std::unordered_map<OpCode, std::vector<int>> paramSizeOfOpCode = {
-    { OpCode::bipush, {1} },    { OpCode::ipush, {4} },    
-    { OpCode::popn, {4} },
-    { OpCode::loadc, {2} },    { OpCode::loada, {2, 4} },
-    { OpCode::snew, {4} },
-    
-    { OpCode::jmp, {2} },
-    { OpCode::je, {2} }, { OpCode::jne, {2} }, { OpCode::jl, {2} }, { OpCode::jge, {2} }, { OpCode::jg, {2} }, { OpCode::jle, {2} },
+// the single spec of all opcodes:
+// X(opcode, mnemonic, size of the first operand, size of the second operand)
+#define VM_OPCODE_SPEC(X) \
+    X(nop,     "nop",     0, 0) \
+    X(bipush,  "bipush",  1, 0) X(ipush,   "ipush",   4, 0) \
+    X(pop,     "pop",     0, 0) X(pop2,    "pop2",    0, 0) X(popn,    "popn",    4, 0) \
+    X(dup,     "dup",     0, 0) X(dup2,    "dup2",    0, 0) \
+    X(loadc,   "loadc",   2, 0) X(loada,   "loada",   2, 4) \
+    X(_new,    "new",     0, 0) \
+    X(snew,    "snew",    4, 0) \
+    X(iload,   "iload",   0, 0) X(dload,   "dload",   0, 0) X(aload,   "aload",   0, 0) \
+    X(iaload,  "iaload",  0, 0) X(daload,  "daload",  0, 0) X(aaload,  "aaload",  0, 0) \
+    X(istore,  "istore",  0, 0) X(dstore,  "dstore",  0, 0) X(astore,  "astore",  0, 0) \
+    X(iastore, "iastore", 0, 0) X(dastore, "dastore", 0, 0) X(aastore, "aastore", 0, 0) \
+    X(iadd,    "iadd",    0, 0) X(dadd,    "dadd",    0, 0) \
+    X(isub,    "isub",    0, 0) X(dsub,    "dsub",    0, 0) \
+    X(imul,    "imul",    0, 0) X(dmul,    "dmul",    0, 0) \
+    X(idiv,    "idiv",    0, 0) X(ddiv,    "ddiv",    0, 0) \
+    X(ineg,    "ineg",    0, 0) X(dneg,    "dneg",    0, 0) \
+    X(icmp,    "icmp",    0, 0) X(dcmp,    "dcmp",    0, 0) \
+    X(i2d,     "i2d",     0, 0) X(d2i,     "d2i",     0, 0) X(i2c,     "i2c",     0, 0) \
+    X(jmp,     "jmp",     2, 0) \
+    X(je,      "je",      2, 0) X(jne,     "jne",     2, 0) X(jl,      "jl",      2, 0) \
+    X(jge,     "jge",     2, 0) X(jg,      "jg",      2, 0) X(jle,     "jle",     2, 0) \
+    X(call,    "call",    2, 0) \
+    X(ret,     "ret",     0, 0) \
+    X(iret,    "iret",    0, 0) X(dret,    "dret",    0, 0) X(aret,    "aret",    0, 0) \
+    X(iprint,  "iprint",  0, 0) X(dprint,  "dprint",  0, 0) X(cprint,  "cprint",  0, 0) X(sprint,  "sprint",  0, 0) \
+    X(printl,  "printl",  0, 0) \
+    X(iscan,   "iscan",   0, 0) X(dscan,   "dscan",   0, 0) X(cscan,   "cscan",   0, 0)
 
-    { OpCode::call, {2} },
+struct OpCodeInfo {
+    const char* name;   // nullptr if the code is not an opcode
+    u1 paramCount;
+    u1 paramSizes[2];   // bytes of each operand
+    u1 size;            // bytes of all operands
 };
 
-#define NAME(op) { #op, OpCode::op }
-const std::unordered_map<std::string, OpCode> opCodeOfName = {
-    NAME(nop),
-
-    NAME(bipush), NAME(ipush),
-    NAME(pop),    NAME(pop2), NAME(popn),
-    NAME(dup),    NAME(dup2),
-    NAME(loadc),  NAME(loada),
-    {"new", OpCode::_new},
-    NAME(snew),
-        
-    NAME(iload),   NAME(dload),   NAME(aload),
-    NAME(iaload),  NAME(daload),  NAME(aaload),
-    NAME(istore),  NAME(dstore),  NAME(astore),
-    NAME(iastore), NAME(dastore), NAME(aastore),
-        
-    NAME(iadd), NAME(dadd),
-    NAME(isub), NAME(dsub),
-    NAME(imul), NAME(dmul),
-    NAME(idiv), NAME(ddiv),
-    NAME(ineg), NAME(dneg),
-    NAME(icmp), NAME(dcmp),
-        
-    NAME(i2d), NAME(d2i), NAME(i2c),
-        
-    NAME(jmp),
-    NAME(je), NAME(jne), NAME(jl), NAME(jge), NAME(jg), NAME(jle),
-
-    NAME(call),
-    NAME(ret),
-    NAME(iret), NAME(dret), NAME(aret),
-
-    NAME(iprint), NAME(dprint), NAME(cprint), NAME(sprint),
-    NAME(printl),
-    NAME(iscan),  NAME(dscan),  NAME(cscan),
+constexpr std::array<OpCodeInfo, 256> makeOpCodeInfo() {
+    std::array<OpCodeInfo, 256> t{};
+    #define X(op, name, x, y) t[static_cast<u1>(OpCode::op)] = OpCodeInfo{name, (x != 0) + (y != 0), {x, y}, x + y};
+    VM_OPCODE_SPEC(X)
+    #undef X
+    return t;
+}
+
+// metadata of every opcode, indexed by the opcode byte
+inline constexpr std::array<OpCodeInfo, 256> opCodeInfo = makeOpCodeInfo();
+
+constexpr const OpCodeInfo& infoOf(OpCode op) {
+    return opCodeInfo[static_cast<u1>(op)];
+}
+
+constexpr bool isOpCode(u1 code) {
+    return opCodeInfo[code].name != nullptr;
+}
+
+namespace detail {
+
+inline constexpr OpCode allOpCodes[] = {
+    #define X(op, name, x, y) OpCode::op,
+    VM_OPCODE_SPEC(X)
+    #undef X
 };
-#undef NAME
+
+constexpr char lowerAscii(char ch) {
+    return ('A' <= ch && ch <= 'Z') ? static_cast<char>(ch - 'A' + 'a') : ch;
+}
+
+constexpr u4 mnemonicHash(u4 seed, std::string_view s) {
+    u4 h = seed;
+    for (char ch : s) {
+        h = (h ^ static_cast<u1>(lowerAscii(ch))) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr std::size_t MNEMONIC_TABLE_SIZE = 256;
+
+// the first seed for which no two mnemonics share a slot
+constexpr u4 findMnemonicSeed() {
+    for (u4 seed = 1; seed < 100000; ++seed) {
+        bool used[MNEMONIC_TABLE_SIZE] = {};
+        bool ok = true;
+        for (auto op : allOpCodes) {
+            auto slot = mnemonicHash(seed, infoOf(op).name) % MNEMONIC_TABLE_SIZE;
+            if (used[slot]) {
+                ok = false;
+                break;
+            }
+            used[slot] = true;
+        }
+        if (ok) {
+            return seed;
+        }
+    }
+    return 0;
+}
+
+inline constexpr u4 mnemonicSeed = findMnemonicSeed();
+static_assert(mnemonicSeed != 0, "no perfect hash for the mnemonics");
+
+// slot -> opcode, free slots hold nop and are rejected by the name comparison
+constexpr std::array<OpCode, MNEMONIC_TABLE_SIZE> makeMnemonicTable() {
+    std::array<OpCode, MNEMONIC_TABLE_SIZE> t{};
+    for (auto op : allOpCodes) {
+        t[mnemonicHash(mnemonicSeed, infoOf(op).name) % MNEMONIC_TABLE_SIZE] = op;
+    }
+    return t;
+}
+
+inline constexpr std::array<OpCode, MNEMONIC_TABLE_SIZE> mnemonicTable = makeMnemonicTable();
+
+}
+
+// case-insensitive mnemonic -> opcode
+constexpr bool findOpCode(std::string_view name, OpCode& op) {
+    OpCode candidate = detail::mnemonicTable[detail::mnemonicHash(detail::mnemonicSeed, name) % detail::MNEMONIC_TABLE_SIZE];
+    std::string_view expected = infoOf(candidate).name;
+    if (expected.size() != name.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < name.size(); ++i) {
+        if (detail::lowerAscii(name[i]) != expected[i]) {
+            return false;
+        }
+    }
+    op = candidate;
+    return true;
+}
 
 }
 
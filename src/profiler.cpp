@@ -0,0 +1,141 @@
+#include "./profiler.h"
+#include "./opcode.h"
+#include "./util/print.hpp"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <iomanip>
+#include <string>
+#include <tuple>
+
+namespace vm {
+
+namespace {
+
+// the instructions listed by the report, the annotated disassembly has them all
+const std::size_t HOT_INSTRUCTIONS = 20;
+
+std::string nameOf(const Program& program, int functionIndex) {
+    if (functionIndex < 0) {
+        return ".start";
+    }
+    auto& function = program.functions().at(functionIndex);
+    return std::get<str_t>(program.constants().at(function.nameIndex).value);
+}
+
+double percentOf(u8 count, u8 total) {
+    return total == 0 ? 0 : 100.0 * count / total;
+}
+
+}
+
+Profiler::Profiler(std::size_t functionCount)
+    : _lines(functionCount + 1), _functions(functionCount + 1), _total(0) {
+}
+
+void Profiler::enter(int functionIndex, std::size_t codeSize) {
+    auto& lines = _lines[functionIndex + 1];
+    if (lines.size() < codeSize) {
+        lines.resize(codeSize);
+    }
+    auto& stats = _functions[functionIndex + 1];
+    ++stats.calls;
+    stats.maxDepth = std::max(stats.maxDepth, ++stats.active);
+    _frames.emplace_back(functionIndex, _total);
+}
+
+void Profiler::leave() {
+    auto [functionIndex, entered] = _frames.back();
+    _frames.pop_back();
+    auto& stats = _functions[functionIndex + 1];
+    if (--stats.active == 0) {
+        stats.inclusive += _total - entered;
+    }
+}
+
+void Profiler::report(const Program& program, std::ostream& out) const {
+    // the frames still open, as after a runtime error, end here
+    auto inclusive = _functions;
+    for (auto [functionIndex, entered] : _frames) {
+        auto& stats = inclusive[functionIndex + 1];
+        if (stats.active != 0) {
+            stats.inclusive += _total - entered;
+            stats.active = 0;
+        }
+    }
+
+    std::array<u8, 256> byOpCode{};
+    std::vector<u8> exclusive(_lines.size());
+    std::vector<std::tuple<u8, int, addr_t>> hot;
+    for (std::size_t slot = 0; slot < _lines.size(); ++slot) {
+        auto& lines = _lines[slot];
+        if (lines.empty()) {
+            continue;
+        }
+        int functionIndex = static_cast<int>(slot) - 1;
+        auto& source = program.source(functionIndex);
+        for (std::size_t ip = 0; ip < lines.size(); ++ip) {
+            if (lines[ip] == 0) {
+                continue;
+            }
+            byOpCode[static_cast<u1>(source.at(ip).op)] += lines[ip];
+            exclusive[slot] += lines[ip];
+            hot.emplace_back(lines[ip], functionIndex, static_cast<addr_t>(ip));
+        }
+    }
+
+    println(out, "executed", _total, "instructions");
+    out << std::fixed << std::setprecision(2);
+
+    std::vector<std::pair<u8, u1>> opcodes;
+    for (std::size_t code = 0; code < byOpCode.size(); ++code) {
+        if (byOpCode[code] != 0) {
+            opcodes.emplace_back(byOpCode[code], static_cast<u1>(code));
+        }
+    }
+    std::sort(opcodes.begin(), opcodes.end(), std::greater<>());
+    out << '\n' << std::left << std::setw(10) << "opcode" << std::right
+        << std::setw(16) << "count" << std::setw(9) << "%" << '\n';
+    for (auto [count, code] : opcodes) {
+        out << std::left << std::setw(10) << infoOf(static_cast<OpCode>(code)).name << std::right
+            << std::setw(16) << count << std::setw(9) << percentOf(count, _total) << '\n';
+    }
+
+    std::vector<std::size_t> functions;
+    for (std::size_t slot = 0; slot < _functions.size(); ++slot) {
+        if (inclusive[slot].calls != 0) {
+            functions.push_back(slot);
+        }
+    }
+    std::sort(functions.begin(), functions.end(), [&](std::size_t a, std::size_t b) {
+        return exclusive[a] != exclusive[b] ? exclusive[a] > exclusive[b] : a < b;
+    });
+    out << '\n' << std::left << std::setw(24) << "function" << std::right << std::setw(12) << "calls"
+        << std::setw(16) << "inclusive" << std::setw(16) << "exclusive" << std::setw(9) << "%"
+        << std::setw(11) << "max depth" << '\n';
+    for (auto slot : functions) {
+        auto& stats = inclusive[slot];
+        out << std::left << std::setw(24) << nameOf(program, static_cast<int>(slot) - 1) << std::right
+            << std::setw(12) << stats.calls << std::setw(16) << stats.inclusive
+            << std::setw(16) << exclusive[slot] << std::setw(9) << percentOf(exclusive[slot], _total)
+            << std::setw(11) << stats.maxDepth << '\n';
+    }
+
+    auto shown = std::min(hot.size(), HOT_INSTRUCTIONS);
+    std::partial_sort(hot.begin(), hot.begin() + shown, hot.end(), [](auto& a, auto& b) {
+        return std::get<0>(a) != std::get<0>(b) ? std::get<0>(a) > std::get<0>(b) : a < b;
+    });
+    out << '\n' << std::left << std::setw(40) << "instruction" << std::right
+        << std::setw(16) << "count" << std::setw(9) << "%" << '\n';
+    for (std::size_t i = 0; i < shown; ++i) {
+        auto [count, functionIndex, ip] = hot[i];
+        std::ostringstream where;
+        print(where, nameOf(program, functionIndex) + ":" + std::to_string(ip), program.source(functionIndex).at(ip));
+        out << std::left << std::setw(40) << where.str() << std::right
+            << std::setw(16) << count << std::setw(9) << percentOf(count, _total) << '\n';
+    }
+    out << std::defaultfloat << std::setprecision(6) << '\n';
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef PROFILER_H_INCLUDED
+#define PROFILER_H_INCLUDED
+
+#include "./type.h"
+#include "./program.h"
+
+#include <cstddef>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace vm {
+
+// exact counts of a run: every instruction executed and every call, for -p.
+// a VM given one runs a separate loop that feeds it, the usual loop is untouched
+class Profiler {
+public:
+    explicit Profiler(std::size_t functionCount);
+
+    void count(int functionIndex, addr_t ip) {
+        ++_lines[functionIndex + 1][ip];
+        ++_total;
+    }
+    // a call into the function, or a frame that was there when profiling started
+    void enter(int functionIndex, std::size_t codeSize);
+    // the innermost function returned
+    void leave();
+    bool started() const { return !_frames.empty(); }
+
+    // how many times each instruction was executed, [0] for .start and [i+1] for function i
+    const std::vector<std::vector<u8>>& lines() const { return _lines; }
+    // the opcodes, the functions and the instructions, the most executed first
+    void report(const Program& program, std::ostream& out) const;
+
+private:
+    struct FunctionStats {
+        u8 calls = 0;
+        // instructions from the outermost call to its return, recursive calls are not counted twice
+        u8 inclusive = 0;
+        std::size_t active = 0;
+        std::size_t maxDepth = 0;
+    };
+    std::vector<std::vector<u8>> _lines;
+    std::vector<FunctionStats> _functions;
+    // the function of each frame and the total when it was entered
+    std::vector<std::pair<int, u8>> _frames;
+    u8 _total;
+};
+
+}
+
+#endif
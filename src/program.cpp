@@ -0,0 +1,144 @@
+#include "./program.h"
+#include "./exception.h"
+
+namespace vm {
+
+Program::Program(File file, bool callMain) : _file(std::move(file)), _decodedCount(0) {
+    u4 mainIndex = 0;
+    for (auto& fun : _file.functions) {
+        if (fun.nameIndex >= _file.constants.size()) {
+            throw InvalidFile("function name index out of range");
+        }
+        if (auto& constant = _file.constants.at(fun.nameIndex); constant.type == Constant::Type::STRING) {
+            if (std::get<str_t>(constant.value) == "main") {
+                break;
+            }
+        }
+        else {
+            throw InvalidFile("function name not found");
+        }
+        ++mainIndex;
+    }
+    if (mainIndex == _file.functions.size()) {
+        throw InvalidFile("main not found");
+    }
+    if (callMain) {
+        _file.start.push_back(Instruction{OpCode::snew, _file.functions[mainIndex].paramSize});
+        _file.start.push_back(Instruction{OpCode::call, mainIndex});
+    }
+
+    auto count = _file.functions.size() + 1;
+    _code.resize(count);
+    _packed = std::make_unique<std::atomic<bool>[]>(count);
+    _code[0] = pack(_file.start);
+    _packed[0].store(true, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < _file.functions.size(); ++i) {
+        if (_file.functions[i].body == nullptr) {
+            _code[i + 1] = pack(_file.functions[i].instructions);
+            _packed[i + 1].store(true, std::memory_order_relaxed);
+        }
+    }
+    _decodedCount.store(_file.decodedCount, std::memory_order_relaxed);
+    buildStringPool();
+}
+
+Program::Program(File file, std::vector<Code> code)
+    : _file(std::move(file)), _code(std::move(code)), _decodedCount(_file.functions.size()) {
+    if (_code.size() != _file.functions.size() + 1) {
+        throw InvalidFile("packed code does not match the function table");
+    }
+    _packed = std::make_unique<std::atomic<bool>[]>(_code.size());
+    _unpacked = std::make_unique<std::atomic<bool>[]>(_code.size());
+    for (std::size_t i = 0; i < _code.size(); ++i) {
+        _packed[i].store(true, std::memory_order_relaxed);
+        _unpacked[i].store(false, std::memory_order_relaxed);
+    }
+    buildStringPool();
+}
+
+const Program::Code& Program::code(int functionIndex) const {
+    auto slot = static_cast<std::size_t>(functionIndex + 1);
+    if (!_packed[slot].load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(_lazyMutex);
+        if (!_packed[slot].load(std::memory_order_relaxed)) {
+            _code[slot] = pack(_file.instructions_of(functionIndex));
+            _decodedCount.fetch_add(1, std::memory_order_relaxed);
+            _packed[slot].store(true, std::memory_order_release);
+        }
+    }
+    return _code[slot];
+}
+
+const std::vector<Instruction>& Program::source(int functionIndex) const {
+    if (_unpacked != nullptr) {
+        auto slot = static_cast<std::size_t>(functionIndex + 1);
+        auto& instructions = functionIndex < 0 ? _file.start : _file.functions.at(functionIndex).instructions;
+        if (!_unpacked[slot].load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(_lazyMutex);
+            if (!_unpacked[slot].load(std::memory_order_relaxed)) {
+                instructions = unpack(_code[slot]);
+                _unpacked[slot].store(true, std::memory_order_release);
+            }
+        }
+        return instructions;
+    }
+    if (functionIndex < 0) {
+        return _file.start;
+    }
+    // decodes the body if needed
+    code(functionIndex);
+    return _file.functions.at(functionIndex).instructions;
+}
+
+Program::Code Program::pack(const std::vector<Instruction>& instructions) {
+    Code code;
+    code.code.reserve(instructions.size());
+    for (auto& ins : instructions) {
+        if (ins.op == OpCode::loada) {
+            code.code.push_back(PackedInstruction{ins.op, static_cast<u4>(code.wideOperands.size())});
+            code.wideOperands.emplace_back(static_cast<u2>(ins.x), static_cast<addr_t>(ins.y));
+        }
+        else {
+            code.code.push_back(PackedInstruction{ins.op, ins.x});
+        }
+    }
+    return code;
+}
+
+// loada is the only instruction with a second operand, every other y is 0
+std::vector<Instruction> Program::unpack(const Code& code) {
+    std::vector<Instruction> instructions;
+    instructions.reserve(code.code.size());
+    for (auto& ins : code.code) {
+        if (ins.op == OpCode::loada) {
+            auto& [level, offset] = code.wideOperands.at(ins.x);
+            instructions.push_back(Instruction{ins.op, level, static_cast<u4>(offset)});
+        }
+        else {
+            instructions.push_back(Instruction{ins.op, ins.x, 0});
+        }
+    }
+    return instructions;
+}
+
+void Program::buildStringPool() {
+    _stringOffset.assign(_file.constants.size(), -1);
+    addr_t end = 0;
+    for (std::size_t i = 0; i < _file.constants.size(); ++i) {
+        auto& c = _file.constants[i];
+        if (c.type != Constant::Type::STRING) {
+            continue;
+        }
+        auto& str = std::get<str_t>(c.value);
+        addr_t size = static_cast<addr_t>(str.length() + 1);
+        _stringPoolRecord.emplace_back(end, size);
+        _stringOffset[i] = end;
+        for (auto ch : str) {
+            _stringPoolImage.push_back(ch & 0xff);
+        }
+        _stringPoolImage.push_back('\0');
+        end += size;
+    }
+}
+
+}
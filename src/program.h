@@ -0,0 +1,79 @@
+#ifndef PROGRAM_H_INCLUDED
+#define PROGRAM_H_INCLUDED
+
+#include "./type.h"
+#include "./instruction.h"
+#include "./constant.h"
+#include "./function.h"
+#include "./data.h"
+#include "./file.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace vm {
+
+// the read-only, loaded form of a binary: the packed code, the constants,
+// the function table and the string literals every run starts with.
+// any number of VMs on any threads can run one Program through a shared pointer
+class Program {
+public:
+    // the packed code of .start or of a function
+    struct Code {
+        std::vector<PackedInstruction> code;
+        // the operands of loada, indexed by its x
+        std::vector<std::pair<u2, addr_t>> wideOperands;
+    };
+
+    // callMain: end .start with the call of main(), which every run but VM::bakeStart needs
+    explicit Program(File file, bool callMain = true);
+    // code packed before, e.g. by ProgramCache: [0] is .start with the call of main(), [i+1] function i.
+    // file holds the constants, the function table and the data section without any instructions,
+    // source() unpacks them on first use
+    Program(File file, std::vector<Code> code);
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    // -1 for .start, a function of a lazily loaded binary is decoded and packed on first use
+    const Code& code(int functionIndex) const;
+    // the instructions as decoded, for diagnostics
+    const std::vector<Instruction>& source(int functionIndex) const;
+    const std::vector<Constant>& constants() const { return _file.constants; }
+    const std::vector<Function>& functions() const { return _file.functions; }
+    const std::optional<DataSection>& data() const { return _file.data; }
+    std::size_t decodedCount() const { return _decodedCount.load(std::memory_order_relaxed); }
+
+    // the string literals as laid out from the start of the heap:
+    // their content, their allocations, and the offset of each string constant
+    const std::vector<slot_t>& stringPoolImage() const { return _stringPoolImage; }
+    const std::vector<std::pair<addr_t, addr_t>>& stringPoolRecord() const { return _stringPoolRecord; }
+    addr_t stringOffset(u2 index) const { return _stringOffset.at(index); }
+
+private:
+    static Code pack(const std::vector<Instruction>& instructions);
+    static std::vector<Instruction> unpack(const Code& code);
+    void buildStringPool();
+
+private:
+    // function bodies of a lazy binary are decoded into it, under _lazyMutex
+    mutable File _file;
+    // [0] is .start, [i+1] is function i
+    mutable std::vector<Code> _code;
+    mutable std::unique_ptr<std::atomic<bool>[]> _packed;
+    // only for code packed before: whether the instructions of [i] are in _file yet
+    mutable std::unique_ptr<std::atomic<bool>[]> _unpacked;
+    mutable std::mutex _lazyMutex;
+    mutable std::atomic<std::size_t> _decodedCount;
+    std::vector<slot_t> _stringPoolImage;
+    std::vector<std::pair<addr_t, addr_t>> _stringPoolRecord;
+    std::vector<addr_t> _stringOffset;
+};
+
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include "./sampler.h"
+#include "./util/print.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace vm {
+
+const std::size_t Sampler::DEFAULT_CAPACITY = 1 << 22;
+const std::size_t Sampler::MAX_FRAMES = 512;
+
+namespace {
+
+// the sampler the handler feeds
+std::atomic<Sampler*> current{nullptr};
+
+}
+
+Sampler::Sampler(std::chrono::microseconds interval, std::size_t capacity)
+    : _interval(interval), _vm(nullptr), _timer(nullptr), _running(false),
+      _ring(std::make_unique<int[]>(capacity)), _capacity(capacity),
+      _head(0), _tail(0), _dropped(0), _frames(std::make_unique<int[]>(MAX_FRAMES)), _samples(0) {
+}
+
+Sampler::~Sampler() {
+    stop();
+}
+
+void Sampler::start(const VM& vm) {
+    _vm = &vm;
+    current.store(this);
+    struct sigaction action{};
+    action.sa_handler = onSignal;
+    // a read or a write of the program goes on after a sample
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    // the CPU time of this thread, and the signal goes to it, not to a writer thread
+    sigevent event{};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = ::gettid();
+    timer_t timer;
+    if (::timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) != 0) {
+        current.store(nullptr);
+        throw std::system_error(errno, std::generic_category(), "timer_create");
+    }
+    _timer = timer;
+    _running = true;
+    itimerspec spec{};
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(_interval).count();
+    spec.it_interval.tv_sec = ns / 1000000000;
+    spec.it_interval.tv_nsec = ns % 1000000000;
+    spec.it_value = spec.it_interval;
+    ::timer_settime(timer, 0, &spec, nullptr);
+}
+
+void Sampler::stop() {
+    if (!_running) {
+        return;
+    }
+    ::timer_delete(static_cast<timer_t>(_timer));
+    _running = false;
+    // a signal on its way finds no sampler
+    current.store(nullptr);
+    drain();
+}
+
+void Sampler::onSignal(int) {
+    int saved = errno;
+    if (auto sampler = current.load(std::memory_order_relaxed); sampler != nullptr) {
+        sampler->take();
+    }
+    errno = saved;
+}
+
+// in the handler: nothing but loads and stores, into memory allocated beforehand
+void Sampler::take() noexcept {
+    auto depth = _vm->sampleFrames(_frames.get(), MAX_FRAMES);
+    if (depth == 0) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    auto kept = std::min(depth, MAX_FRAMES);
+    auto head = _head.load(std::memory_order_relaxed);
+    auto tail = _tail.load(std::memory_order_acquire);
+    if (_capacity - (head - tail) < kept + 2) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    _ring[head++ % _capacity] = static_cast<int>(depth);
+    _ring[head++ % _capacity] = static_cast<int>(kept);
+    for (std::size_t i = 0; i < kept; ++i) {
+        _ring[head++ % _capacity] = _frames[i];
+    }
+    _head.store(head, std::memory_order_release);
+}
+
+void Sampler::drain() {
+    auto tail = _tail.load(std::memory_order_relaxed);
+    auto head = _head.load(std::memory_order_acquire);
+    std::vector<int> frames;
+    while (tail != head) {
+        auto depth = static_cast<std::size_t>(_ring[tail++ % _capacity]);
+        auto kept = static_cast<std::size_t>(_ring[tail++ % _capacity]);
+        frames.resize(kept);
+        for (auto& f : frames) {
+            f = _ring[tail++ % _capacity];
+        }
+        ++_stacks[{frames, depth > kept}];
+        ++_samples;
+    }
+    _tail.store(tail, std::memory_order_release);
+}
+
+void Sampler::writeFolded(const Program& program, std::ostream& out) {
+    drain();
+    auto& functions = program.functions();
+    auto& constants = program.constants();
+    std::string line;
+    for (auto& [stack, count] : _stacks) {
+        auto& [frames, cut] = stack;
+        line.clear();
+        if (cut) {
+            line += "[truncated]";
+        }
+        for (auto f : frames) {
+            if (!line.empty()) {
+                line += ';';
+            }
+            // a frame caught while it was being written
+            if (f < -1 || f >= static_cast<int>(functions.size())) {
+                line += "[unknown]";
+            }
+            else if (f == -1) {
+                line += ".start";
+            }
+            else {
+                line += std::get<str_t>(constants.at(functions[f].nameIndex).value);
+            }
+        }
+        println(out, line, count);
+    }
+}
+
+}
@@ -0,0 +1,67 @@
+#ifndef SAMPLER_H_INCLUDED
+#define SAMPLER_H_INCLUDED
+
+#include "./type.h"
+#include "./program.h"
+#include "./vm.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace vm {
+
+// samples the frames of a run every interval of CPU time of its thread, from a SIGPROF handler,
+// so the run is timed as it is and not slowed down by counting every instruction.
+// the handler only copies the frames into a ring, they are taken out and counted by drain()
+class Sampler {
+public:
+    // slots of the ring, a sample takes two and one per frame
+    static const std::size_t DEFAULT_CAPACITY;
+    // the innermost frames kept by a sample of a deeper stack
+    static const std::size_t MAX_FRAMES;
+
+    explicit Sampler(std::chrono::microseconds interval, std::size_t capacity = DEFAULT_CAPACITY);
+    ~Sampler();
+    Sampler(const Sampler&) = delete;
+    Sampler& operator=(const Sampler&) = delete;
+
+    // samples vm, which runs on the calling thread, until stop(). one sampler runs at a time
+    void start(const VM& vm);
+    void stop();
+    // counts the samples in the ring, the ring would drop the next ones when it is full
+    void drain();
+    // one line per stack, the functions from the outermost joined by ';' then the number of samples,
+    // as flamegraph.pl and speedscope read it
+    void writeFolded(const Program& program, std::ostream& out);
+    u8 samples() const { return _samples; }
+    u8 dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+    static void onSignal(int);
+    void take() noexcept;
+
+private:
+    std::chrono::microseconds _interval;
+    const VM* _vm;
+    void* _timer;
+    bool _running;
+    // a sample is its depth, the number of frames kept, then the function of each frame
+    std::unique_ptr<int[]> _ring;
+    std::size_t _capacity;
+    std::atomic<std::size_t> _head;
+    std::atomic<std::size_t> _tail;
+    std::atomic<u8> _dropped;
+    std::unique_ptr<int[]> _frames;
+    // by the functions of the frames, and whether the sample was cut
+    std::map<std::pair<std::vector<int>, bool>, u8> _stacks;
+    u8 _samples;
+};
+
+}
+
+#endif
@@ -0,0 +1,250 @@
+#include "./scheduler.h"
+#include "./vm.h"
+#include "./io.h"
+#include "./util/print.hpp"
+
+#include <cerrno>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace vm {
+
+const u8 Scheduler::DEFAULT_QUANTUM = 100000;
+const std::size_t Scheduler::MAX_PENDING_OUTPUT = 1 << 20;
+
+struct Scheduler::Task {
+    int inFd;
+    int outFd;
+    Done done;
+    std::unique_ptr<Input> input;
+    // formatted output, written from written on
+    BufferOutput output;
+    std::size_t written = 0;
+    std::ostringstream err;
+    std::unique_ptr<VM> vm;
+    // the run could not be set up
+    std::string error;
+    std::size_t slot;
+    bool started = false;
+    bool finished = false;
+    bool closed = false;
+    bool waitingForInput = false;
+    bool waitingForOutput = false;
+    bool inWatched = false;
+    bool outWatched = false;
+};
+
+Scheduler::Scheduler(u8 quantum) : _quantum(quantum), _epoll(::epoll_create1(EPOLL_CLOEXEC)) {
+    if (_epoll < 0) {
+        throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    }
+}
+
+Scheduler::~Scheduler() {
+    ::close(_epoll);
+}
+
+void Scheduler::add(std::shared_ptr<const Program> program, int inFd, int outFd, Done done) {
+    for (int fd : {inFd, outFd}) {
+        if (fd >= 0) {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+    auto task = std::make_unique<Task>();
+    task->inFd = inFd;
+    task->outFd = outFd;
+    task->done = std::move(done);
+    if (inFd >= 0) {
+        task->input = std::make_unique<FdInput>(inFd);
+    }
+    else {
+        task->input = std::make_unique<SpanInput>(std::string_view());
+    }
+    if (_idle.empty()) {
+        task->vm = VM::make_vm(std::move(program), task->output, *task->input, task->err);
+    }
+    else {
+        task->vm = std::move(_idle.back());
+        _idle.pop_back();
+        task->vm->load(std::move(program));
+        task->vm->attach(task->output, *task->input, task->err);
+    }
+    task->vm->setLimits(_limits);
+    task->slot = _tasks.size();
+    _ready.push_back(task.get());
+    _tasks.push_back(std::move(task));
+}
+
+void Scheduler::run() {
+    std::vector<epoll_event> events(64);
+    while (!_tasks.empty()) {
+        _retired.clear();
+        // everything runnable gets a turn, the runs it makes ready wait for the next round
+        for (auto turns = _ready.size(); turns > 0; --turns) {
+            auto task = _ready.front();
+            _ready.pop_front();
+            step(*task);
+        }
+        if (_tasks.empty()) {
+            break;
+        }
+        int count = ::epoll_wait(_epoll, events.data(), static_cast<int>(events.size()), _ready.empty() ? -1 : 0);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "epoll_wait");
+        }
+        for (int i = 0; i < count; ++i) {
+            auto& task = *static_cast<Task*>(events[i].data.ptr);
+            if (task.closed) {
+                continue;
+            }
+            auto happened = events[i].events;
+            if (task.waitingForOutput && (happened & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                task.waitingForOutput = !writeOutput(task)
+                    && (task.finished || task.output.str().size() - task.written > MAX_PENDING_OUTPUT);
+            }
+            if (task.waitingForInput && (happened & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                task.waitingForInput = false;
+            }
+            if (task.finished && !task.waitingForOutput) {
+                finish(task);
+                continue;
+            }
+            if (!task.waitingForInput && !task.waitingForOutput) {
+                _ready.push_back(&task);
+            }
+            watch(task);
+        }
+    }
+    _retired.clear();
+}
+
+void Scheduler::step(Task& task) {
+    auto status = VM::Status::finished;
+    try {
+        if (!task.started) {
+            task.started = true;
+            task.vm->begin();
+        }
+        status = task.vm->proceed(_quantum);
+    }
+    catch (const std::exception& e) {
+        task.error = e.what();
+        println(task.err, e.what());
+    }
+    task.finished = status == VM::Status::finished;
+    task.waitingForInput = status == VM::Status::waitingForInput;
+    // a reader that does not keep up stops the run, and a finished run waits until all is written
+    task.waitingForOutput = !writeOutput(task)
+        && (task.finished || task.output.str().size() - task.written > MAX_PENDING_OUTPUT);
+    if (task.finished && !task.waitingForOutput) {
+        finish(task);
+        return;
+    }
+    if (!task.waitingForInput && !task.waitingForOutput) {
+        _ready.push_back(&task);
+    }
+    watch(task);
+}
+
+// true when nothing is left to write
+bool Scheduler::writeOutput(Task& task) {
+    if (task.outFd < 0) {
+        return true;
+    }
+    auto& data = task.output.str();
+    while (task.written < data.size()) {
+        auto n = ::write(task.outFd, data.data() + task.written, data.size() - task.written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            // the reader is gone, the rest is dropped
+            break;
+        }
+        task.written += n;
+    }
+    task.output.clear();
+    task.written = 0;
+    return true;
+}
+
+// a file descriptor is watched only while a run waits for it, a hung up pipe would be reported
+// again and again otherwise. a regular file never makes a run wait, so it is never added
+void Scheduler::watch(Task& task) {
+    const auto update = [&](int fd, u4 wanted, bool& watched) {
+        epoll_event event{};
+        event.events = wanted;
+        event.data.ptr = &task;
+        int result = 0;
+        if (wanted != 0) {
+            result = ::epoll_ctl(_epoll, watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+            watched = true;
+        }
+        else if (watched) {
+            result = ::epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, &event);
+            watched = false;
+        }
+        if (result < 0) {
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+        }
+    };
+    u4 in = task.waitingForInput ? static_cast<u4>(EPOLLIN) : 0;
+    u4 out = task.waitingForOutput ? static_cast<u4>(EPOLLOUT) : 0;
+    // a socket is both, and epoll takes a file descriptor once
+    if (task.inFd >= 0 && task.inFd == task.outFd) {
+        update(task.inFd, in | out, task.inWatched);
+        return;
+    }
+    if (task.inFd >= 0) {
+        update(task.inFd, in, task.inWatched);
+    }
+    if (task.outFd >= 0) {
+        update(task.outFd, out, task.outWatched);
+    }
+}
+
+void Scheduler::finish(Task& task) {
+    task.waitingForInput = false;
+    task.waitingForOutput = false;
+    watch(task);
+    task.closed = true;
+
+    Finished result;
+    result.error = task.error.empty() ? task.vm->error() : task.error;
+    result.limitExceeded = task.vm->limitExceeded();
+    result.instructions = task.vm->executedInstructions();
+    if (task.outFd < 0) {
+        result.output = task.output.str();
+    }
+    result.diagnostics = task.err.str();
+    _idle.push_back(std::move(task.vm));
+
+    // swapped with the last task, it is freed when no event can refer to it any more
+    auto slot = task.slot;
+    auto self = std::move(_tasks[slot]);
+    if (slot + 1 != _tasks.size()) {
+        _tasks[slot] = std::move(_tasks.back());
+        _tasks[slot]->slot = slot;
+    }
+    _tasks.pop_back();
+    if (task.done) {
+        task.done(result);
+    }
+    else {
+        std::cerr << result.diagnostics;
+    }
+    _retired.push_back(std::move(self));
+}
+
+}
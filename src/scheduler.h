@@ -0,0 +1,73 @@
+#ifndef SCHEDULER_H_INCLUDED
+#define SCHEDULER_H_INCLUDED
+
+#include "./type.h"
+#include "./program.h"
+#include "./vm.h"
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace vm {
+
+// runs many VMs on one thread, each in turn for a quantum of instructions.
+// a VM waiting for input, or whose output is not taken by the reader,
+// is put aside until epoll reports its file descriptor ready
+class Scheduler {
+public:
+    static const u8 DEFAULT_QUANTUM;
+    // output not written yet beyond which a VM waits for its reader
+    static const std::size_t MAX_PENDING_OUTPUT;
+
+    struct Finished {
+        // empty if the run reached its end
+        std::string error;
+        bool limitExceeded;
+        u8 instructions;
+        // the output, when it is kept in memory
+        std::string output;
+        // runtime error and stack trace
+        std::string diagnostics;
+    };
+    using Done = std::function<void(Finished&)>;
+
+    explicit Scheduler(u8 quantum = DEFAULT_QUANTUM);
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // a run of program reading inFd and writing outFd, which are made non-blocking and not closed.
+    // -1 for no input, or to keep the output in memory, no two runs may share one.
+    // done is called once the output is written, without it the diagnostics go to std::cerr
+    void add(std::shared_ptr<const Program> program, int inFd, int outFd, Done done = {});
+    // for the runs added from now on
+    void setLimits(const VM::Limits& limits) { _limits = limits; }
+    // until every run has finished
+    void run();
+
+private:
+    struct Task;
+    void step(Task& task);
+    bool writeOutput(Task& task);
+    void watch(Task& task);
+    void finish(Task& task);
+
+private:
+    u8 _quantum;
+    VM::Limits _limits;
+    int _epoll;
+    std::vector<std::unique_ptr<Task>> _tasks;
+    std::deque<Task*> _ready;
+    // finished, kept until the events at hand are handled
+    std::vector<std::unique_ptr<Task>> _retired;
+    // VMs of finished runs, the next runs take them instead of allocating memory again
+    std::vector<std::unique_ptr<VM>> _idle;
+};
+
+}
+
+#endif
@@ -0,0 +1,460 @@
+#include "./server.h"
+#include "./vm.h"
+#include "./file.h"
+#include "./io.h"
+#include "./exception.h"
+#include "./util/hash.hpp"
+#include "./util/print.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// the largest binary, input or frame accepted
+const std::size_t MAX_MESSAGE_SIZE = std::size_t(1) << 30;
+// decoded programs the daemon keeps
+const std::size_t MAX_CACHED_PROGRAMS = 256;
+// output is sent in frames of about this size, and at the end of the run
+const std::size_t OUTPUT_FRAME_SIZE = 1 << 16;
+// instructions between two looks at whether the client is still there
+const vm::u8 CLIENT_CHECK_QUANTUM = 1 << 20;
+
+// false at the end of the stream before the first byte
+bool readFully(int fd, void* data, std::size_t size) {
+    auto p = static_cast<char*>(data);
+    std::size_t done = 0;
+    while (done < size) {
+        auto n = ::read(fd, p + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        if (n == 0) {
+            if (done == 0) {
+                return false;
+            }
+            break;
+        }
+        done += n;
+    }
+    if (done < size) {
+        throw std::runtime_error("connection closed in the middle of a message");
+    }
+    return true;
+}
+
+void readExactly(int fd, void* data, std::size_t size) {
+    if (!readFully(fd, data, size)) {
+        throw std::runtime_error("connection closed in the middle of a message");
+    }
+}
+
+void writeFully(int fd, std::string_view data) {
+    while (!data.empty()) {
+        // a client that went away must not take the daemon down with SIGPIPE
+        auto n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "send");
+        }
+        data.remove_prefix(n);
+    }
+}
+
+template <typename T>
+void putBig(std::string& out, T value) {
+    for (int i = sizeof(T) - 1; i >= 0; --i) {
+        out.push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+template <typename T>
+T getBig(const char* p) {
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value = (value << 8) | static_cast<unsigned char>(p[i]);
+    }
+    return value;
+}
+
+template <typename T>
+T readBig(int fd) {
+    char buf[sizeof(T)];
+    readExactly(fd, buf, sizeof buf);
+    return getBig<T>(buf);
+}
+
+void putBlob(std::string& out, std::string_view data) {
+    putBig<vm::u4>(out, static_cast<vm::u4>(data.size()));
+    out.append(data);
+}
+
+std::string readBlob(int fd) {
+    auto size = readBig<vm::u4>(fd);
+    if (size > MAX_MESSAGE_SIZE) {
+        throw std::runtime_error("message too large");
+    }
+    std::string data(size, '\0');
+    readExactly(fd, data.data(), size);
+    return data;
+}
+
+void sendFrame(int fd, char kind, std::string_view payload) {
+    std::string frame(1, kind);
+    frame.reserve(5 + payload.size());
+    putBlob(frame, payload);
+    writeFully(fd, frame);
+}
+
+void sendStatus(int fd, RunStatus status, vm::u8 instructions, vm::u8 nanoseconds, const std::string& error) {
+    std::string payload(1, static_cast<char>(status));
+    putBig<vm::u8>(payload, instructions);
+    putBig<vm::u8>(payload, nanoseconds);
+    payload.append(error);
+    sendFrame(fd, 'S', payload);
+}
+
+class Socket {
+public:
+    explicit Socket(int fd) : _fd(fd) {}
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+    ~Socket() {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+    int fd() const { return _fd; }
+
+private:
+    int _fd;
+};
+
+sockaddr_un socketAddress(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        throw std::runtime_error("socket path too long: " + path);
+    }
+    std::copy(path.begin(), path.end(), addr.sun_path);
+    return addr;
+}
+
+// streams the output of a run to the client
+class SocketOutput : public vm::Output {
+public:
+    explicit SocketOutput(int fd) : _fd(fd), _failed(false) {}
+    virtual void write(const char* data, std::size_t size) override {
+        _buffer.append(data, size);
+        if (_buffer.size() >= OUTPUT_FRAME_SIZE) {
+            flush();
+        }
+    }
+    virtual void flush() override {
+        if (!_buffer.empty() && !_failed) {
+            try {
+                sendFrame(_fd, 'O', _buffer);
+            }
+            catch (const std::exception&) {
+                // the client is gone, the run is abandoned at the next check
+                _failed = true;
+            }
+        }
+        _buffer.clear();
+    }
+    bool failed() const { return _failed; }
+
+private:
+    int _fd;
+    std::string _buffer;
+    bool _failed;
+};
+
+// the decoded programs by the SHA-256 of their binaries,
+// a client asks by the hash alone, so it must not be possible to craft a binary that collides
+class Programs {
+public:
+    std::shared_ptr<const vm::Program> find(const sha256_t& hash) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _programs.find(hash);
+        return it == _programs.end() ? nullptr : it->second;
+    }
+    void insert(const sha256_t& hash, std::shared_ptr<const vm::Program> program) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // a run still holds an evicted program
+        if (_programs.size() >= MAX_CACHED_PROGRAMS) {
+            _programs.erase(_programs.begin());
+        }
+        _programs[hash] = std::move(program);
+    }
+
+private:
+    std::mutex _mutex;
+    struct Key {
+        std::size_t operator()(const sha256_t& hash) const {
+            std::size_t h;
+            std::memcpy(&h, hash.data(), sizeof h);
+            return h;
+        }
+    };
+    std::unordered_map<sha256_t, std::shared_ptr<const vm::Program>, Key> _programs;
+};
+
+// a worker runs all its requests on one VM, its memory is allocated once
+struct Worker {
+    std::unique_ptr<vm::VM> vm;
+    std::shared_ptr<const vm::Program> program;
+    std::ostringstream err;
+};
+
+// the client closed its end, nobody waits for the run any more
+bool hungUp(int fd) {
+    pollfd p{fd, 0, 0};
+    return ::poll(&p, 1, 0) > 0 && (p.revents & (POLLHUP | POLLERR)) != 0;
+}
+
+// false when the client went away during the run, which was abandoned then
+bool runRequest(int fd, Worker& worker, std::shared_ptr<const vm::Program> program, const std::string& input,
+                const vm::VM::Limits& limits) {
+    SocketOutput output(fd);
+    vm::SpanInput in(input);
+    worker.err.str(std::string());
+    if (worker.vm == nullptr) {
+        worker.vm = vm::VM::make_vm(program, output, in, worker.err);
+    }
+    else {
+        if (worker.program != program) {
+            worker.vm->load(program);
+        }
+        worker.vm->attach(output, in, worker.err);
+    }
+    worker.program = std::move(program);
+    worker.vm->setLimits(limits);
+
+    auto begin = std::chrono::steady_clock::now();
+    std::string error;
+    try {
+        // in quanta, so that the run of a client that is gone does not hold the worker
+        worker.vm->begin();
+        while (worker.vm->proceed(CLIENT_CHECK_QUANTUM) != vm::VM::Status::finished) {
+            if (output.failed() || hungUp(fd)) {
+                return false;
+            }
+        }
+        error = worker.vm->error();
+    }
+    catch (const std::exception& e) {
+        error = e.what();
+        println(worker.err, e.what());
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+    output.flush();
+    if (auto diagnostics = worker.err.str(); !diagnostics.empty()) {
+        sendFrame(fd, 'E', diagnostics);
+    }
+    auto status = error.empty() ? RunStatus::finished
+        : worker.vm->limitExceeded() ? RunStatus::limited : RunStatus::failed;
+    sendStatus(fd, status, worker.vm->executedInstructions(), elapsed.count(), error);
+    return true;
+}
+
+void handleConnection(int fd, Worker& worker, Programs& programs, const vm::VM::Limits& limits) {
+    char kind;
+    while (readFully(fd, &kind, 1)) {
+        std::shared_ptr<const vm::Program> program;
+        std::string binary;
+        sha256_t hash;
+        if (kind == 'H') {
+            readExactly(fd, hash.data(), hash.size());
+            program = programs.find(hash);
+        }
+        else if (kind == 'B') {
+            binary = readBlob(fd);
+            hash = sha256(binary.data(), binary.size());
+            program = programs.find(hash);
+        }
+        else {
+            throw std::runtime_error("unknown request");
+        }
+        auto input = readBlob(fd);
+        if (program == nullptr && kind == 'H') {
+            sendFrame(fd, 'M', std::string_view());
+            continue;
+        }
+        if (program == nullptr) {
+            try {
+                program = std::make_shared<const vm::Program>(
+                    File::parse_binary(reinterpret_cast<const vm::u1*>(binary.data()), binary.size()));
+            }
+            catch (const std::exception& e) {
+                sendStatus(fd, RunStatus::rejected, 0, 0, e.what());
+                continue;
+            }
+            programs.insert(hash, program);
+        }
+        if (!runRequest(fd, worker, std::move(program), input, limits)) {
+            return;
+        }
+    }
+}
+
+}
+
+void serve(const std::string& path, unsigned threads, const vm::VM::Limits& limits) {
+    Socket listener(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (listener.fd() < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    auto addr = socketAddress(path);
+    // the socket of a daemon that is gone
+    ::unlink(path.c_str());
+    if (::bind(listener.fd(), reinterpret_cast<const sockaddr*>(&addr), sizeof addr) != 0
+        || ::listen(listener.fd(), SOMAXCONN) != 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot listen on " + path);
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<int> pending;
+    bool stop = false;
+    Programs programs;
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < std::max(threads, 1u); ++t) {
+        pool.emplace_back([&] {
+            Worker worker;
+            while (true) {
+                int fd;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return stop || !pending.empty(); });
+                    if (pending.empty()) {
+                        return;
+                    }
+                    fd = pending.front();
+                    pending.pop_front();
+                }
+                Socket connection(fd);
+                try {
+                    handleConnection(fd, worker, programs, limits);
+                }
+                catch (const std::exception& e) {
+                    println(std::cerr, "connection dropped:", e.what());
+                }
+            }
+        });
+    }
+
+    int error;
+    while (true) {
+        int fd = ::accept4(listener.fd(), nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            error = errno;
+            break;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(fd);
+        cv.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto& th : pool) {
+        th.join();
+    }
+    throw std::system_error(error, std::generic_category(), "accept");
+}
+
+RunStatus request(const std::string& path, const std::string& binaryPath, const std::string& input,
+                  std::ostream& out, std::ostream& err, bool stats) {
+    std::ifstream in(binaryPath, std::ios::binary | std::ios::in);
+    if (!in) {
+        throw InvalidFile("cannot open " + binaryPath);
+    }
+    std::string binary(std::istreambuf_iterator<char>(in), {});
+
+    Socket connection(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (connection.fd() < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    auto addr = socketAddress(path);
+    if (::connect(connection.fd(), reinterpret_cast<const sockaddr*>(&addr), sizeof addr) != 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot connect to " + path);
+    }
+    int fd = connection.fd();
+
+    // the daemon most likely has the program already, the binary is sent only when it asks
+    std::string message(1, 'H');
+    auto hash = sha256(binary.data(), binary.size());
+    message.append(reinterpret_cast<const char*>(hash.data()), hash.size());
+    putBlob(message, input);
+    writeFully(fd, message);
+    while (true) {
+        char kind;
+        readExactly(fd, &kind, 1);
+        auto payload = readBlob(fd);
+        switch (kind) {
+        case 'O':
+            out.write(payload.data(), payload.size());
+            out.flush();
+            break;
+        case 'E':
+            err << payload;
+            break;
+        case 'M':
+            message.assign(1, 'B');
+            putBlob(message, binary);
+            putBlob(message, input);
+            writeFully(fd, message);
+            break;
+        case 'S': {
+            if (payload.size() < 17) {
+                throw std::runtime_error("invalid reply");
+            }
+            auto status = static_cast<RunStatus>(payload[0]);
+            auto instructions = getBig<vm::u8>(payload.data() + 1);
+            auto seconds = getBig<vm::u8>(payload.data() + 9) / 1e9;
+            out.flush();
+            if (status == RunStatus::rejected) {
+                println(err, payload.substr(17));
+            }
+            if (stats) {
+                println(err, "executed", instructions, "instructions in", seconds, "s,",
+                    static_cast<vm::u8>(instructions / std::max(seconds, 1e-9)), "instructions/s");
+            }
+            return status;
+        }
+        default:
+            throw std::runtime_error("invalid reply");
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+#include "./vm.h"
+#include "./util/parallel.hpp"
+
+#include <ostream>
+#include <string>
+
+// a daemon that keeps decoded programs and allocated VMs between runs, over a Unix socket.
+//
+// a request is the binary, or the hash of its bytes, and the whole input:
+//   'B' u4 size, the binary   or   'H' the 32-byte SHA-256 of the binary
+//   u4 size, the input
+// the reply is a sequence of frames, u1 kind u4 size then the payload:
+//   'O' output, streamed while the program runs
+//   'E' runtime error and stack trace
+//   'M' the hash is unknown, the request must be sent again with the binary
+//   'S' the end: u1 status (a RunStatus), u8 instructions, u8 nanoseconds, then the error message
+// numbers are big-endian, and a connection may carry any number of requests
+
+// the exit status of a run, as the client returns it
+enum class RunStatus {
+    finished = 0,
+    failed = 1,
+    rejected = 2,
+    limited = 3,
+};
+
+// accepts connections on path until killed, the requests run on `threads` workers,
+// each of them keeps one VM. every run is held to limits
+void serve(const std::string& path, unsigned threads = default_thread_count(),
+           const vm::VM::Limits& limits = vm::VM::Limits());
+
+// runs the binary file through the daemon at path.
+// copies the output to out and the diagnostics to err, also the speed when stats is set
+RunStatus request(const std::string& path, const std::string& binary, const std::string& input,
+                  std::ostream& out, std::ostream& err, bool stats = false);
+
+#endif
@@ -0,0 +1,290 @@
+#include "./vm.h"
+#include "./exception.h"
+#include "./util/mapped_file.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace vm {
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = {'C', '0', 'V', 'M', 'S', 'N', 'A', 'P'};
+const u4 SNAPSHOT_FORMAT = 2;
+
+// zero runs shorter than this are stored inline
+const addr_t MIN_ZERO_GAP = 16;
+
+struct SnapshotHeader {
+    char magic[8];
+    u4 format;
+    u4 contextsCount;
+    u8 fingerprint;
+    u8 counterInstruction;
+    i4 sp;
+    i4 bp;
+    i4 ip;
+    i4 functionIndex;
+    u4 heapRecordCount;
+    u4 stackRunsCount;
+    u4 heapRunsCount;
+};
+
+struct SnapshotContext {
+    i4 prevPC;
+    i4 prevSP;
+    i4 prevBP;
+    i4 BP;
+    i4 staticLink;
+    i4 functionIndex;
+    u4 functionLevel;
+};
+
+// [offset, offset+count) of a memory region, followed by count slots
+struct SnapshotRun {
+    i4 offset;
+    i4 count;
+};
+
+u8 mix(u8 h, const void* data, std::size_t size) {
+    auto p = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// identifies the program a snapshot belongs to
+u8 fingerprintOf(const Program& program) {
+    u8 h = 0xcbf29ce484222325ull;
+    const auto mixInstructions = [&](const std::vector<Instruction>& v) {
+        for (auto& ins : v) {
+            h = mix(h, &ins.op, sizeof ins.op);
+            h = mix(h, &ins.x, sizeof ins.x);
+            h = mix(h, &ins.y, sizeof ins.y);
+        }
+        u8 size = v.size();
+        h = mix(h, &size, sizeof size);
+    };
+    for (auto& c : program.constants()) {
+        h = mix(h, &c.type, sizeof c.type);
+        switch (c.type) {
+        case Constant::Type::STRING: {
+            auto& s = std::get<str_t>(c.value);
+            h = mix(h, s.data(), s.size());
+        } break;
+        case Constant::Type::INT:    h = mix(h, &std::get<int_t>(c.value), sizeof(int_t));       break;
+        case Constant::Type::DOUBLE: h = mix(h, &std::get<double_t>(c.value), sizeof(double_t)); break;
+        }
+    }
+    mixInstructions(program.source(-1));
+    for (std::size_t i = 0; i < program.functions().size(); ++i) {
+        auto& fun = program.functions()[i];
+        h = mix(h, &fun.nameIndex, sizeof fun.nameIndex);
+        h = mix(h, &fun.paramSize, sizeof fun.paramSize);
+        h = mix(h, &fun.level, sizeof fun.level);
+        mixInstructions(program.source(static_cast<int>(i)));
+    }
+    return h;
+}
+
+template <typename T>
+void put(std::string& out, const T& v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof v);
+}
+
+// appends the non-zero parts of base[begin, end) and returns the number of runs
+u4 putRuns(std::string& out, const slot_t* base, addr_t begin, addr_t end) {
+    u4 count = 0;
+    addr_t i = begin;
+    while (i < end) {
+        while (i < end && base[i] == 0) {
+            ++i;
+        }
+        if (i == end) {
+            break;
+        }
+        addr_t runEnd = i;
+        addr_t zeros = 0;
+        for (addr_t j = i; j < end && zeros < MIN_ZERO_GAP; ++j) {
+            if (base[j] == 0) {
+                ++zeros;
+            }
+            else {
+                zeros = 0;
+                runEnd = j + 1;
+            }
+        }
+        put(out, SnapshotRun{i, runEnd - i});
+        out.append(reinterpret_cast<const char*>(base + i), (runEnd - i) * sizeof(slot_t));
+        ++count;
+        i = runEnd;
+    }
+    return count;
+}
+
+class SnapshotReader {
+public:
+    SnapshotReader(const unsigned char* p, std::size_t size) : _p(p), _end(p + size) {}
+    template <typename T>
+    void get(T& v) {
+        bytes(&v, sizeof v);
+    }
+    void bytes(void* dst, std::size_t size) {
+        if (static_cast<std::size_t>(_end - _p) < size) {
+            throw InvalidFile("invalid snapshot file");
+        }
+        std::memcpy(dst, _p, size);
+        _p += size;
+    }
+    // copies runs into base[0, limit)
+    void runs(u4 count, slot_t* base, addr_t limit) {
+        for (u4 i = 0; i < count; ++i) {
+            SnapshotRun run;
+            get(run);
+            if (run.offset < 0 || run.count < 0 || run.offset > limit - run.count) {
+                throw InvalidFile("invalid snapshot file");
+            }
+            bytes(base + run.offset, run.count * sizeof(slot_t));
+        }
+    }
+    bool atEnd() const { return _p == _end; }
+
+private:
+    const unsigned char* _p;
+    const unsigned char* _end;
+};
+
+}
+
+void VM::saveSnapshot(const std::string& path) {
+    // what is printed so far belongs to the run before the checkpoint
+    flushOutput();
+
+    addr_t heapEnd = MIN_HEAP_ADDR;
+    if (!_heapRecord.empty()) {
+        heapEnd = _heapRecord.back().first + _heapRecord.back().second;
+    }
+    std::string body;
+    for (auto& c : _contexts) {
+        put(body, SnapshotContext{c.prevPC, c.prevSP, c.prevBP, c.BP, c.staticLink, c.functionIndex, c.functionLevel});
+    }
+    for (auto& r : _heapRecord) {
+        put(body, r);
+    }
+    std::string stackRuns, heapRuns;
+    u4 stackRunsCount = putRuns(stackRuns, _stack.get(), 0, _sp);
+    u4 heapRunsCount = putRuns(heapRuns, _heap.get(), 0, heapEnd - MIN_HEAP_ADDR);
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof header);
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC);
+    header.format = SNAPSHOT_FORMAT;
+    header.contextsCount = _contexts.size();
+    header.fingerprint = fingerprintOf(*_program);
+    header.counterInstruction = _counterInstruction;
+    header.sp = _sp;
+    header.bp = _bp;
+    header.ip = _ip;
+    header.functionIndex = _functionIndex;
+    header.heapRecordCount = _heapRecord.size();
+    header.stackRunsCount = stackRunsCount;
+    header.heapRunsCount = heapRunsCount;
+
+    auto temp = path + ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::out | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof header);
+        out.write(body.data(), body.size());
+        out.write(stackRuns.data(), stackRuns.size());
+        out.write(heapRuns.data(), heapRuns.size());
+        if (!out) {
+            out.close();
+            std::remove(temp.c_str());
+            throw IOError();
+        }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        throw IOError();
+    }
+}
+
+void VM::loadSnapshot(const std::string& path) {
+    MappedFile file(path);
+    if (!file.mapped()) {
+        throw InvalidFile("cannot open snapshot file");
+    }
+    SnapshotReader in(file.data(), file.size());
+    SnapshotHeader header;
+    in.get(header);
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC) != 0
+        || header.format != SNAPSHOT_FORMAT) {
+        throw InvalidFile("invalid snapshot file");
+    }
+    if (header.fingerprint != fingerprintOf(*_program)) {
+        throw InvalidFile("the snapshot was taken from another program");
+    }
+    if (header.sp < MIN_STACK_ADDR || header.sp > MAX_STACK_ADDR
+        || header.bp < MIN_STACK_ADDR || header.bp > header.sp
+        || header.contextsCount == 0
+        || header.functionIndex < -1 || header.functionIndex >= static_cast<i4>(_program->functions().size())) {
+        throw InvalidFile("invalid snapshot file");
+    }
+
+    _contexts.clear();
+    for (u4 i = 0; i < header.contextsCount; ++i) {
+        SnapshotContext c;
+        in.get(c);
+        if (c.functionIndex < -1 || c.functionIndex >= static_cast<i4>(_program->functions().size())
+            || c.staticLink < 0 || static_cast<u4>(c.staticLink) >= header.contextsCount) {
+            throw InvalidFile("invalid snapshot file");
+        }
+        Context context;
+        context.prevPC = c.prevPC;
+        context.prevSP = c.prevSP;
+        context.prevBP = c.prevBP;
+        context.BP = c.BP;
+        context.staticLink = c.staticLink;
+        context.functionIndex = c.functionIndex;
+        context.functionName = c.functionIndex < 0 ? "__START__"
+            : std::get<str_t>(_program->constants().at(_program->functions().at(c.functionIndex).nameIndex).value);
+        context.functionLevel = c.functionLevel;
+        pushContext(std::move(context));
+    }
+    _heapRecord.clear();
+    addr_t heapEnd = MIN_HEAP_ADDR;
+    for (u4 i = 0; i < header.heapRecordCount; ++i) {
+        std::pair<addr_t, addr_t> r;
+        in.get(r);
+        if (r.first != heapEnd || r.second < 0 || r.first + r.second >= MAX_HEAP_ADDR) {
+            throw InvalidFile("invalid snapshot file");
+        }
+        heapEnd = r.first + r.second;
+        _heapRecord.push_back(r);
+    }
+    in.runs(header.stackRunsCount, _stack.get(), header.sp);
+    in.runs(header.heapRunsCount, _heap.get(), heapEnd - MIN_HEAP_ADDR);
+    if (!in.atEnd()) {
+        throw InvalidFile("invalid snapshot file");
+    }
+
+    _sp = header.sp;
+    _stackHighWater = std::max(_stackHighWater, header.sp);
+    _heapHighWater = std::max(_heapHighWater, heapEnd);
+    _bp = header.bp;
+    _counterInstruction = header.counterInstruction;
+    enterCode(header.functionIndex);
+    if (header.ip < 0 || static_cast<std::size_t>(header.ip) >= _codeSize) {
+        throw InvalidFile("invalid snapshot file");
+    }
+    _ip = header.ip;
+}
+
+}
@@ -0,0 +1,137 @@
+#include "./tracer.h"
+#include "./util/json.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+namespace vm {
+
+const std::size_t Tracer::DEFAULT_CAPACITY = 1 << 20;
+
+namespace {
+
+std::string nameOf(const Program& program, int functionIndex) {
+    if (functionIndex < 0) {
+        return ".start";
+    }
+    auto& function = program.functions().at(functionIndex);
+    return std::get<str_t>(program.constants().at(function.nameIndex).value);
+}
+
+// trace_event counts in microseconds
+void printMicroseconds(std::ostream& out, u8 ns) {
+    char buffer[32];
+    int n = std::snprintf(buffer, sizeof buffer, "%llu.%03llu",
+                          static_cast<unsigned long long>(ns / 1000), static_cast<unsigned long long>(ns % 1000));
+    out.write(buffer, n);
+}
+
+}
+
+Tracer::Tracer(std::size_t maxDepth, u4 every, std::size_t capacity)
+    : _maxDepth(maxDepth), _every(every == 0 ? 1 : every), _calls(0),
+      _origin(Clock::now()), _ring(capacity == 0 ? 1 : capacity), _next(0) {
+}
+
+void Tracer::record(char phase, int functionIndex, OpCode op, Clock::time_point at, u8 duration) {
+    auto& event = _ring[_next++ % _ring.size()];
+    event.time = std::chrono::duration_cast<std::chrono::nanoseconds>(at - _origin).count();
+    event.duration = duration;
+    event.functionIndex = functionIndex;
+    event.phase = phase;
+    event.op = op;
+}
+
+void Tracer::call(int functionIndex) {
+    bool inside = !_traced.empty() && _traced.back();
+    bool traced = (_maxDepth == 0 || _traced.size() < _maxDepth) && (inside || ++_calls % _every == 0);
+    _traced.push_back(traced);
+    if (traced) {
+        record('B', functionIndex, OpCode::call, Clock::now());
+    }
+}
+
+void Tracer::ret() {
+    // the frames there were before tracing started return untraced
+    if (_traced.empty()) {
+        return;
+    }
+    bool traced = _traced.back();
+    _traced.pop_back();
+    if (traced) {
+        record('E', -1, OpCode::ret, Clock::now());
+    }
+}
+
+void Tracer::instant(OpCode op, int functionIndex) {
+    record('i', functionIndex, op, Clock::now());
+}
+
+void Tracer::scan(OpCode op, int functionIndex, Clock::time_point began) {
+    auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - began).count();
+    record('X', functionIndex, op, began, waited);
+}
+
+void Tracer::writeJson(const Program& program, std::ostream& out) const {
+    std::vector<std::string> names(program.functions().size() + 1);
+    const auto name = [&](int functionIndex) -> const std::string& {
+        auto& cached = names[functionIndex + 1];
+        if (cached.empty()) {
+            cached = nameOf(program, functionIndex);
+        }
+        return cached;
+    };
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    const auto begin = [&](const char* phase, u8 time) {
+        out << (first ? "" : ",\n") << "{\"ph\":\"" << phase << "\",\"pid\":1,\"tid\":1,\"ts\":";
+        printMicroseconds(out, time);
+        first = false;
+    };
+    // an end whose beginning was overwritten is left out, and what is still open ends with the last event
+    std::size_t open = 0;
+    u8 last = 0;
+    for (u8 i = overwritten(); i < _next; ++i) {
+        auto& event = _ring[i % _ring.size()];
+        last = std::max(last, event.time + event.duration);
+        switch (event.phase) {
+        case 'B':
+            ++open;
+            begin("B", event.time);
+            out << ",\"cat\":\"call\",\"name\":";
+            printJsonString(out, name(event.functionIndex));
+            out << '}';
+            break;
+        case 'E':
+            if (open == 0) {
+                break;
+            }
+            --open;
+            begin("E", event.time);
+            out << '}';
+            break;
+        default:
+            begin(event.phase == 'X' ? "X" : "i", event.time);
+            if (event.phase == 'X') {
+                out << ",\"dur\":";
+                printMicroseconds(out, event.duration);
+            }
+            else {
+                out << ",\"s\":\"t\"";
+            }
+            out << ",\"cat\":\"io\",\"name\":\"" << infoOf(event.op).name << "\",\"args\":{\"function\":";
+            printJsonString(out, name(event.functionIndex));
+            out << "}}";
+            break;
+        }
+    }
+    for (; open > 0; --open) {
+        begin("E", last);
+        out << '}';
+    }
+    out << "\n]}\n";
+}
+
+}
@@ -0,0 +1,62 @@
+#ifndef TRACER_H_INCLUDED
+#define TRACER_H_INCLUDED
+
+#include "./type.h"
+#include "./opcode.h"
+#include "./program.h"
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+namespace vm {
+
+// records the calls, returns and I/O of a run with their times, for --trace.
+// the events go into a ring allocated up front, the oldest are overwritten once it is full,
+// and become Chrome trace_event JSON, which Perfetto and chrome://tracing open, after the run
+class Tracer {
+public:
+    using Clock = std::chrono::steady_clock;
+    static const std::size_t DEFAULT_CAPACITY;
+
+    // calls nested deeper than maxDepth are not traced, 0 for no limit.
+    // with every above 1, one in every calls that are not traced yet is traced, with all it calls
+    explicit Tracer(std::size_t maxDepth = 0, u4 every = 1, std::size_t capacity = DEFAULT_CAPACITY);
+
+    void call(int functionIndex);
+    void ret();
+    // a print
+    void instant(OpCode op, int functionIndex);
+    // a scan, from when it began to wait for its input
+    void scan(OpCode op, int functionIndex, Clock::time_point began);
+
+    // the events the ring still holds
+    void writeJson(const Program& program, std::ostream& out) const;
+    u8 events() const { return _next; }
+    u8 overwritten() const { return _next > _ring.size() ? _next - _ring.size() : 0; }
+
+private:
+    struct Event {
+        u8 time;        // ns from the start
+        u8 duration;
+        int functionIndex;
+        char phase;     // 'B', 'E', 'i' or 'X'
+        OpCode op;
+    };
+    void record(char phase, int functionIndex, OpCode op, Clock::time_point at, u8 duration = 0);
+
+private:
+    std::size_t _maxDepth;
+    u4 _every;
+    u8 _calls;
+    Clock::time_point _origin;
+    std::vector<Event> _ring;
+    u8 _next;
+    // whether each call in progress is traced
+    std::vector<bool> _traced;
+};
+
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef JSON_H_INCLUDED
+#define JSON_H_INCLUDED
+
+#include <ostream>
+#include <string>
+
+// s as a JSON string literal, quotes included
+inline void printJsonString(std::ostream& out, const std::string& s) {
+    const char* hex = "0123456789abcdef";
+    out << '"';
+    for (unsigned char ch : s) {
+        switch (ch) {
+        case '"':  out << "\\\""; break;
+        case '\\': out << "\\\\"; break;
+        case '\n': out << "\\n";  break;
+        case '\t': out << "\\t";  break;
+        default:
+            if (ch < 0x20) {
+                out << "\\u00" << hex[ch >> 4] << hex[ch & 0xf];
+            }
+            else {
+                out << ch;
+            }
+        }
+    }
+    out << '"';
+}
+
+#endif
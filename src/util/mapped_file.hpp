@@ -0,0 +1,61 @@
+#ifndef MAPPED_FILE_H_INCLUDED
+#define MAPPED_FILE_H_INCLUDED
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// RAII read-only mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        _fd = ::open(path.c_str(), O_RDONLY);
+        if (_fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (::fstat(_fd, &st) != 0) {
+            ::close(_fd);
+            _fd = -1;
+            return;
+        }
+        _regular = S_ISREG(st.st_mode);
+        _size = st.st_size;
+        if (_regular && _size > 0) {
+            _data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+            if (_data == MAP_FAILED) {
+                _data = nullptr;
+            }
+            else {
+                ::madvise(_data, _size, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (_data != nullptr) {
+            ::munmap(_data, _size);
+        }
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+    bool opened() const { return _fd >= 0; }
+    // false if the file could not be mapped (e.g. a pipe)
+    bool mapped() const { return _data != nullptr || (_regular && _size == 0); }
+    const unsigned char* data() const { return static_cast<const unsigned char*>(_data); }
+    std::size_t size() const { return _size; }
+
+private:
+    int _fd = -1;
+    bool _regular = false;
+    void* _data = nullptr;
+    std::size_t _size = 0;
+};
+
+#endif
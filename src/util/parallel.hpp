@@ -0,0 +1,62 @@
+#ifndef PARALLEL_H_INCLUDED
+#define PARALLEL_H_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+inline unsigned default_thread_count() {
+    auto n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// calls fn(i, worker) for every i in [0, count) on up to `threads` threads,
+// which take the indexes in increasing order.
+// worker is in [0, threads) and no two calls with the same worker run at once.
+// rethrows the exception of the smallest failed index.
+template <typename F>
+void parallel_for_workers(std::size_t count, F fn, unsigned threads = default_thread_count()) {
+    threads = static_cast<unsigned>(std::min<std::size_t>(threads, count));
+    if (threads <= 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            fn(i, 0u);
+        }
+        return;
+    }
+    std::atomic<std::size_t> next{0};
+    std::vector<std::exception_ptr> errors(count);
+    const auto work = [&](unsigned worker) {
+        for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count; ) {
+            try {
+                fn(i, worker);
+            }
+            catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(work, t);
+    }
+    work(0);
+    for (auto& th : pool) {
+        th.join();
+    }
+    for (auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+}
+
+// calls fn(i) for every i in [0, count), as parallel_for_workers does
+template <typename F>
+void parallel_for(std::size_t count, F fn, unsigned threads = default_thread_count()) {
+    parallel_for_workers(count, [&fn](std::size_t i, unsigned) { fn(i); }, threads);
+}
+
+#endif
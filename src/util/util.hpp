@@ -6,7 +6,13 @@
 #include <cstdint>
 #include <algorithm>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 
 inline bool is_hex_digit(unsigned char ch) {
     return '0' <= ch && ch <= '9'
@@ -91,6 +97,78 @@ inline double try_to_double(std::string s) {
     }
 }
 
+inline bool is_space(unsigned char ch) {
+    return ch == ' ' || ('\t' <= ch && ch <= '\r');
+}
+
+// accepts exactly what try_to_int() accepts, but reports failures instead of throwing
+inline bool parse_int(std::string_view s, std::int32_t& out) {
+    while (!s.empty() && is_space(s.front())) {
+        s.remove_prefix(1);
+    }
+    char buf[64];
+    if (s.size() >= sizeof buf) {
+        try {
+            out = try_to_int(std::string(s));
+            return true;
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    }
+    std::memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    char* end;
+    errno = 0;
+    if (s.length() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        auto v = std::strtoull(buf, &end, 0);
+        if (end == buf || errno == ERANGE) {
+            return false;
+        }
+        out = static_cast<std::int32_t>(v);
+    }
+    else {
+        auto v = std::strtol(buf, &end, 10);
+        if (end == buf || errno == ERANGE || v < INT_MIN || v > INT_MAX) {
+            return false;
+        }
+        out = static_cast<std::int32_t>(v);
+    }
+    return true;
+}
+
+// accepts exactly what try_to_double() accepts, but reports failures instead of throwing
+inline bool parse_double(std::string_view s, double& out) {
+    char buf[128];
+    if (s.size() >= sizeof buf) {
+        try {
+            out = try_to_double(std::string(s));
+            return true;
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    }
+    std::memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    char* end;
+    errno = 0;
+    if (s.length() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        std::uint64_t bits = std::strtoull(buf, &end, 16);
+        if (end == buf || errno == ERANGE) {
+            return false;
+        }
+        std::memcpy(&out, &bits, sizeof out);
+    }
+    else {
+        out = std::strtod(buf, &end);
+        if (end == buf || errno == ERANGE) {
+            return false;
+        }
+    }
+    return true;
+}
+
 inline std::vector<std::string> split(std::string s, char delimiter) {
     std::vector<std::string> rtv;
     std::string temp = "";
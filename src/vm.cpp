@@ -2,13 +2,80 @@
 #include "./type.h"
 #include "./instruction.h"
 #include "./exception.h"
+#include "./profiler.h"
+#include "./tracer.h"
+#include "./heap_profiler.h"
+#include "./locality.h"
+#include "./util/hash.hpp"
 
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <cstdio>
+#include <charconv>
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <atomic>
+#include <csetjmp>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace vm {
 
+namespace {
+
+// the guard page of the stack the run loop of this thread writes, and where the loop goes on a fault
+thread_local const char* guardBegin = nullptr;
+thread_local const char* guardEnd = nullptr;
+thread_local sigjmp_buf* guardJump = nullptr;
+struct sigaction previousSegv;
+
+// a fault that is not a push goes to the handler there was before,
+// ours stays installed for the next push of any VM
+void forwardSegv(int sig, siginfo_t* info, void* context) {
+    if ((previousSegv.sa_flags & SA_SIGINFO) != 0) {
+        previousSegv.sa_sigaction(sig, info, context);
+        return;
+    }
+    if (previousSegv.sa_handler != SIG_DFL && previousSegv.sa_handler != SIG_IGN) {
+        previousSegv.sa_handler(sig);
+        return;
+    }
+    // one sent by another process is ignored as it was,
+    // a real fault cannot be ignored and would only fault again
+    if (previousSegv.sa_handler == SIG_IGN && info->si_code <= 0) {
+        return;
+    }
+    // the default action ends the process,
+    // the signal raised here stays blocked until the handler returns
+    signal(SIGSEGV, SIG_DFL);
+    raise(SIGSEGV);
+}
+
+void onSegv(int sig, siginfo_t* info, void* context) {
+    auto addr = static_cast<const char*>(info->si_addr);
+    if (guardJump != nullptr && guardBegin <= addr && addr < guardEnd) {
+        siglongjmp(*guardJump, 1);
+    }
+    forwardSegv(sig, info, context);
+}
+
+void installSegvHandler() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        struct sigaction action{};
+        action.sa_sigaction = onSegv;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previousSegv);
+    });
+}
+
+}
+
 const addr_t VM::MIN_STACK_ADDR = 0;
 const addr_t VM::MAX_STACK_ADDR = 0x00ffffff;
 const addr_t VM::MAX_STACK_SIZE = 0x01000000;
@@ -17,71 +84,223 @@ const addr_t VM::MIN_HEAP_ADDR  = 0x01000000;
 const addr_t VM::MAX_HEAP_ADDR  = 0x01ffffff;
 const addr_t VM::MAX_HEAP_SIZE  = 0x01000000;
 
-VM::VM(File file) noexcept : _file(std::move(file)){
+// output longer than this is handed over even without a new line
+const std::size_t VM::OUTPUT_BATCH_SIZE = 1 << 16;
+// reading the clock costs about as much as a few dozen instructions
+const u8 VM::CLOCK_CHECK_INTERVAL = 1 << 16;
+// a .start that loops is left to run, the binary keeps it unbaked
+const u8 VM::BAKE_INSTRUCTION_LIMIT = 1 << 28;
+
+VM::VM(std::shared_ptr<const Program> program) noexcept
+    : _stackHighWater(0), _heapHighWater(MIN_HEAP_ADDR), _guardedStack(false), _framesMoving(0), _output(nullptr), _err(&std::cerr),
+      _profiler(nullptr), _tracer(nullptr), _heapProfiler(nullptr), _locality(nullptr) {
+    load(std::move(program));
+}
+
+std::unique_ptr<VM> VM::make_vm(std::shared_ptr<const Program> program, std::ostream& out, std::istream& in, std::ostream& err) {
+    auto output = std::make_unique<StreamOutput>(out);
+    auto input = std::make_unique<StreamInput>(in);
+    auto vm = make_vm(std::move(program), *output, *input, err);
+    vm->_ownedOutput = std::move(output);
+    vm->_ownedInput = std::move(input);
+    return vm;
+}
+
+std::unique_ptr<VM> VM::make_vm(std::shared_ptr<const Program> program, Output& out, Input& in, std::ostream& err) {
+    auto vm = std::make_unique<VM>(std::move(program));
+    vm->allocateMemory();
+    vm->attach(out, in, err);
+    return std::move(vm);
+}
+
+void VM::load(std::shared_ptr<const Program> program) {
+    if (_stack != nullptr) {
+        reset();
+    }
+    _program = std::move(program);
+    _codeOf.assign(_program->functions().size() + 1, nullptr);
+    _privateCode.clear();
+    _privateCode.resize(_codeOf.size());
+    _traps.clear();
     init();
 }
 
-std::unique_ptr<VM> VM::make_vm(File file) {
-    // found main function
-    vm::u4 mainIndex = 0;
-    bool mainFound = false;
-    for (auto& fun : file.functions) {
-        if (0 > fun.nameIndex || fun.nameIndex >= file.constants.size()) {
-            throw InvalidFile("function name index out of range");
-        }
-        if (auto& constant = file.constants.at(fun.nameIndex); constant.type == vm::Constant::Type::STRING) {
-            if (std::get<vm::str_t>(constant.value) == "main") {
-                file.start.push_back(Instruction{OpCode::snew, fun.paramSize});
-                file.start.push_back(Instruction{OpCode::call, mainIndex});
-                break;
-            }
-        }
-        else {
-            throw InvalidFile("function name not found");
+void VM::allocateMemory() {
+    auto stack = static_cast<slot_t*>(std::calloc(MAX_STACK_ADDR-MIN_STACK_ADDR, sizeof(slot_t)));
+    auto heap  = static_cast<slot_t*>(std::calloc(MAX_HEAP_ADDR-MIN_HEAP_ADDR, sizeof(slot_t)));
+    _stack.reset(stack);
+    _heap.reset(heap);
+    if (stack == nullptr || heap == nullptr) {
+        throw std::bad_alloc();
+    }
+}
+
+void VM::FreeSlots::operator()(slot_t* p) const {
+    if (mapping != nullptr) {
+        ::munmap(mapping, mappedSize);
+    }
+    else {
+        std::free(p);
+    }
+}
+
+void VM::useGuardPage() {
+    reset();
+    auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    auto bytes = static_cast<std::size_t>(MAX_STACK_ADDR - MIN_STACK_ADDR) * sizeof(slot_t);
+    auto stackBytes = (bytes + page - 1) / page * page;
+    auto size = stackBytes + page;
+    auto mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    auto guard = static_cast<char*>(mapping) + stackBytes;
+    if (::mprotect(guard, page, PROT_NONE) != 0) {
+        ::munmap(mapping, size);
+        throw std::bad_alloc();
+    }
+    // slot MAX_STACK_ADDR, the first one no push may write, begins the guard page
+    auto stack = reinterpret_cast<slot_t*>(guard) - (MAX_STACK_ADDR - MIN_STACK_ADDR);
+    _stack = std::unique_ptr<slot_t[], FreeSlots>(stack, FreeSlots{mapping, size});
+    _guardedStack = true;
+    _stackHighWater = MAX_STACK_ADDR;
+    installSegvHandler();
+}
+
+void VM::attach(Output& out, Input& in, std::ostream& err) {
+    _output = &out;
+    _scanner = InputScanner(in);
+    // a prompt must be on its way before waiting for the answer,
+    // but the interpreter does not wait for it to be written
+    _scanner.setBeforeRead([this] {
+        handOverOutput();
+        if (_output != nullptr) {
+            _output->handOver();
         }
-        ++mainIndex;
+    });
+    _err = &err;
+    _ownedOutput.reset();
+    _ownedInput.reset();
+}
+
+addr_t VM::heapUsed() const {
+    return _heapRecord.empty() ? 0 : _heapRecord.back().first + _heapRecord.back().second - MIN_HEAP_ADDR;
+}
+
+void VM::reset() noexcept {
+    if (_guardedStack) {
+        // how far the pushes went is not known, the pages are dropped and read as zeros again
+        ::madvise(_stack.get_deleter().mapping, _stack.get_deleter().mappedSize, MADV_DONTNEED);
     }
-    if (mainIndex == file.functions.size()) {
-        throw InvalidFile("main not found");
+    else {
+        std::fill(_stack.get(), _stack.get() + _stackHighWater, 0);
+        _stackHighWater = 0;
     }
-    auto vm = std::make_unique<VM>(std::move(file));
-    vm->_stack = std::make_unique<slot_t[]>(MAX_STACK_ADDR-MIN_STACK_ADDR);
-    vm->_heap  = std::make_unique<slot_t[]>(MAX_HEAP_ADDR-MIN_HEAP_ADDR);
-    return std::move(vm);
+    std::fill(_heap.get(), toHeapPtr(_heapHighWater), 0);
+    _heapHighWater = MIN_HEAP_ADDR;
+    init();
 }
 
+volatile std::sig_atomic_t VM::_checkpointSignal = 0;
+
 void VM::init() noexcept {
     prepared = false;
     _sp = 0;
     _bp = 0;
     _ip = 0;
     _counterInstruction = 0;
+    _cooperative = false;
+    _yieldAt = std::numeric_limits<u8>::max();
+    _checkAt = std::numeric_limits<u8>::max();
+    _limitExceeded = false;
+    _suspended = false;
+    _waitingForInput = false;
+    _error.clear();
+    _outBuffer.clear();
     _contexts.clear();
     _heapRecord.clear();
-    _stringLiteralPool.clear();
 }
 
+// the string literals are the first heap allocations, copied from the program
 void VM::buildStringLiteralPool() {
-    u2 i = 0;
-    for (auto it = _file.constants.begin(), ed = _file.constants.end(); it != ed; ++it) {
-        auto& c = *it;
-        if (c.type == vm::Constant::Type::STRING) {
-            str_t str = std::get<str_t>(c.value);
-            addr_t addr = NEW(str.length()+1);
-            _stringLiteralPool[i] = addr;
-            slot_t* dst =  toHeapPtr(addr);
-            for (auto ch : str) {
-                *dst++ = ch & 0xff;
-            }
-            *dst = '\0';
-        }
-        ++i;
+    auto& image = _program->stringPoolImage();
+    if (image.size() >= static_cast<std::size_t>(MAX_HEAP_SIZE)) {
+        throw HeapOverflow();
     }
+    std::copy(image.begin(), image.end(), _heap.get());
+    _heapRecord.clear();
+    for (auto [offset, size] : _program->stringPoolRecord()) {
+        _heapRecord.emplace_back(MIN_HEAP_ADDR + offset, size);
+    }
+    _heapHighWater = std::max(_heapHighWater, MIN_HEAP_ADDR + static_cast<addr_t>(image.size()));
 }
 
 void VM::start() {
-    init();
+    enterProgram();
+    run();
+}
+
+void VM::begin() {
+    enterProgram();
+    _cooperative = true;
+}
+
+VM::Status VM::proceed(u8 quantum) {
+    _yieldAt = quantum == 0 ? std::numeric_limits<u8>::max() : _counterInstruction + quantum;
+    scheduleCheck();
+    if (_suspended) {
+        _codeSize = _suspendedCodeSize;
+        _suspended = false;
+    }
+    _waitingForInput = false;
+    run();
+    if (!_suspended || !_error.empty()) {
+        return Status::finished;
+    }
+    return _waitingForInput ? Status::waitingForInput : Status::yielded;
+}
+
+void VM::enterProgram() {
+    reset();
     buildStringLiteralPool();
+    if (auto& data = _program->data()) {
+        loadData(*data);
+    }
+    enterStart();
+    startBudget();
+}
+
+void VM::startBudget() {
+    if (_limits.seconds > 0) {
+        _deadline = std::chrono::steady_clock::now()
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(_limits.seconds));
+    }
+    scheduleCheck();
+}
+
+void VM::scheduleCheck() {
+    _checkAt = _yieldAt;
+    if (_limits.instructions != 0) {
+        _checkAt = std::min(_checkAt, _limits.instructions);
+    }
+    if (_limits.seconds > 0) {
+        _checkAt = std::min(_checkAt, _counterInstruction + CLOCK_CHECK_INTERVAL);
+    }
+}
+
+// the slow path of jumps and calls, true when a cooperative run must give the thread back
+bool VM::checkBudget() {
+    if (_limits.instructions != 0 && _counterInstruction >= _limits.instructions) {
+        throw LimitExceeded("instruction limit exceeded");
+    }
+    if (_limits.seconds > 0 && std::chrono::steady_clock::now() >= _deadline) {
+        throw LimitExceeded("time limit exceeded");
+    }
+    scheduleCheck();
+    return _counterInstruction >= _yieldAt;
+}
+
+void VM::enterStart() {
     Context globalContext;
     globalContext.prevPC = 0;
     globalContext.prevSP = 0;
@@ -91,29 +310,299 @@ void VM::start() {
     globalContext.functionIndex = -1;
     globalContext.functionName = "__START__";
     globalContext.functionLevel = 0;
-    _currentInstructions = _file.start;
-    _contexts.push_back(globalContext);
+    prepareCode();
+    enterCode(-1);
+    pushContext(std::move(globalContext));
+    prepared = true;
+}
+
+void VM::loadData(const DataSection& data) {
+    // the string literals were allocated first when .start was baked, they come back the same
+    if (data.stack.size() > static_cast<std::size_t>(MAX_STACK_SIZE)
+        || data.heapRecord.size() < _heapRecord.size()
+        || !std::equal(_heapRecord.begin(), _heapRecord.end(), data.heapRecord.begin())) {
+        throw InvalidFile("invalid data section");
+    }
+    addr_t end = MIN_HEAP_ADDR;
+    for (auto [addr, size] : data.heapRecord) {
+        if (addr != end || size < 0 || size > MAX_HEAP_ADDR - addr) {
+            throw InvalidFile("invalid data section");
+        }
+        end = addr + size;
+    }
+    if (data.heap.size() != static_cast<std::size_t>(end - MIN_HEAP_ADDR)) {
+        throw InvalidFile("invalid data section");
+    }
+    std::copy(data.stack.begin(), data.stack.end(), _stack.get());
+    std::copy(data.heap.begin(), data.heap.end(), _heap.get());
+    _heapRecord = data.heapRecord;
+    _sp = static_cast<addr_t>(data.stack.size());
+    _stackHighWater = std::max(_stackHighWater, _sp);
+    _heapHighWater = std::max(_heapHighWater, end);
+}
+
+void VM::bakeStart(File& file) {
+    if (file.data) {
+        return;
+    }
+    file.decode_all();
+    // everything .start can reach must be free of I/O
+    std::vector<bool> reached(file.functions.size());
+    std::vector<const std::vector<Instruction>*> pending{&file.start};
+    while (!pending.empty()) {
+        auto code = pending.back();
+        pending.pop_back();
+        for (auto& ins : *code) {
+            switch (ins.op) {
+            case OpCode::iprint: case OpCode::dprint: case OpCode::cprint: case OpCode::sprint:
+            case OpCode::printl:
+            case OpCode::iscan:  case OpCode::dscan:  case OpCode::cscan:
+                throw InvalidFile(".start does I/O");
+            case OpCode::call:
+                if (ins.x >= file.functions.size()) {
+                    throw InvalidFile("function index out of range");
+                }
+                if (!reached[ins.x]) {
+                    reached[ins.x] = true;
+                    pending.push_back(&file.functions[ins.x].instructions);
+                }
+                break;
+            default: break;
+            }
+        }
+    }
+
+    auto vm = std::make_unique<VM>(std::make_shared<const Program>(file, false));
+    vm->allocateMemory();
+    vm->init();
+    Limits limits;
+    limits.instructions = BAKE_INSTRUCTION_LIMIT;
+    vm->setLimits(limits);
+    vm->buildStringLiteralPool();
+    vm->enterStart();
+    vm->startBudget();
+    vm->runCode();
+
+    DataSection data;
+    data.stack.assign(vm->_stack.get(), vm->_stack.get() + vm->_sp);
+    data.heapRecord = vm->_heapRecord;
+    if (!data.heapRecord.empty()) {
+        auto& last = data.heapRecord.back();
+        data.heap.assign(vm->_heap.get(), vm->toHeapPtr(last.first + last.second));
+    }
+    file.start.clear();
+    file.data = std::move(data);
+}
+
+void VM::resume(const std::string& snapshotPath) {
+    reset();
+    prepareCode();
+    loadSnapshot(snapshotPath);
     prepared = true;
+    startBudget();
     run();
 }
 
-void VM::run() {
-    try {
-        while (_ip < _currentInstructions.size()) {
-            executeInstruction(_currentInstructions.at(_ip));
+void VM::prepareCode() {
+    // the traps left by the last run are taken out
+    for (auto& trap : _traps) {
+        privateCode(trap.functionIndex).code[trap.ip].op = trap.op;
+    }
+    _traps.clear();
+    // a mark in code not fetched yet is armed by codeOf
+    if (_checkpointMark && _codeOf.at(_checkpointMark->first + 1) != nullptr) {
+        armTrap(_checkpointMark->first, _checkpointMark->second);
+    }
+}
+
+const Program::Code& VM::codeOf(int functionIndex) {
+    auto& code = _codeOf[functionIndex + 1];
+    if (code == nullptr) {
+        code = &_program->code(functionIndex);
+        if (_checkpointMark && _checkpointMark->first == functionIndex) {
+            armTrap(functionIndex, _checkpointMark->second);
+        }
+    }
+    return *code;
+}
+
+// the code of a function owned by this VM, copied from the program the first time
+Program::Code& VM::privateCode(int functionIndex) {
+    auto& own = _privateCode[functionIndex + 1];
+    if (own == nullptr) {
+        own = std::make_unique<Program::Code>(codeOf(functionIndex));
+        _codeOf[functionIndex + 1] = own.get();
+        if (functionIndex == _functionIndex) {
+            _code = own->code.data();
+            _wideOperands = own->wideOperands.data();
+        }
+    }
+    return *own;
+}
+
+// switch to the code of a function, -1 for .start
+void VM::enterCode(int functionIndex) {
+    _functionIndex = functionIndex;
+    auto& code = codeOf(functionIndex);
+    _code = code.code.data();
+    _wideOperands = code.wideOperands.data();
+    _codeSize = code.code.size();
+}
+
+void VM::setCheckpoint(std::string path, std::optional<std::pair<int, addr_t>> mark) {
+    _checkpointPath = std::move(path);
+    _checkpointMark = mark;
+}
+
+void VM::enableCheckpointSignal() {
+    std::signal(SIGUSR1, [](int) { _checkpointSignal = 1; });
+}
+
+bool VM::armTrap(int functionIndex, addr_t ip) {
+    auto& code = codeOf(functionIndex).code;
+    if (ip < 0 || static_cast<std::size_t>(ip) >= code.size() || code[ip].op == OpCode::_trap) {
+        return false;
+    }
+    auto& own = privateCode(functionIndex).code;
+    _traps.push_back(Trap{functionIndex, ip, own[ip].op});
+    own[ip].op = OpCode::_trap;
+    return true;
+}
+
+// the trap at the current instruction: put the instruction back,
+// take the checkpoint and then execute the instruction
+void VM::fireTrap() {
+    auto it = std::find_if(_traps.begin(), _traps.end(), [this](const Trap& t) {
+        return t.functionIndex == _functionIndex && t.ip == _ip;
+    });
+    if (it == _traps.end()) {
+        throw InvalidInstruction();
+    }
+    privateCode(_functionIndex).code[_ip].op = it->op;
+    _traps.erase(it);
+    saveSnapshot(_checkpointPath);
+    executeInstruction(_code[_ip]);
+}
+
+void VM::runCode() {
+    if (_profiler != nullptr) {
+        runProfiledCode();
+    }
+    else if (_guardedStack) {
+        runGuardedCode();
+    }
+    else {
+        while (static_cast<std::size_t>(_ip) < _codeSize) {
+            executeInstruction(_code[_ip]);
             ++_ip;
             ++_counterInstruction;
         }
-        if (_contexts.size() != 1) {
-            // no ret at the end of funtion
-            throw InvalidControlTransfer();
-        }
+    }
+    if (_suspended) {
+        return;
+    }
+    if (_contexts.size() != 1) {
+        // no ret at the end of funtion
+        throw InvalidControlTransfer();
+    }
+}
+
+void VM::run() {
+    try {
+        runCode();
+        flushOutput();
     }
     catch (const std::exception& e) {
-        println(std::cerr, "runtime error:", e.what(), "!");
-        println(std::cerr, "occurred at:");
-        printStackTrace(std::cerr);
+        // everything printed before the error must come out before the diagnostics
+        flushOutput();
+        _error = e.what();
+        _limitExceeded = dynamic_cast<const LimitExceeded*>(&e) != nullptr;
+        println(*_err, "runtime error:", e.what(), "!");
+        println(*_err, "occurred at:");
+        printStackTrace(*_err);
+    }
+}
+
+// the pushes of this loop write without a check and a fault in the guard page is the overflow.
+// the other instructions still compare with the high-water mark, pinned at the end so only
+// an overflow takes the branch
+void VM::runGuardedCode() {
+    struct Armed {
+        Armed(sigjmp_buf* jump, const char* begin, const char* end) {
+            guardBegin = begin;
+            guardEnd = end;
+            guardJump = jump;
+        }
+        ~Armed() { guardJump = nullptr; }
+    };
+    sigjmp_buf jump;
+    auto& mapped = _stack.get_deleter();
+    Armed armed(&jump, reinterpret_cast<const char*>(toStackPtr(MAX_STACK_ADDR)),
+                static_cast<const char*>(mapped.mapping) + mapped.mappedSize);
+    if (sigsetjmp(jump, 1) != 0) {
+        throw StackOverflow();
+    }
+    while (static_cast<std::size_t>(_ip) < _codeSize) {
+        auto& ins = _code[_ip];
+        switch (ins.op)
+        {
+        case OpCode::bipush:
+        case OpCode::ipush:
+            _stack[_sp++] = static_cast<int_t>(ins.x);
+            break;
+        case OpCode::dup:
+            ensureStackUsed(1);
+            _stack[_sp] = _stack[_sp-1];
+            ++_sp;
+            break;
+        case OpCode::dup2:
+            ensureStackUsed(2);
+            _stack[_sp] = _stack[_sp-2];
+            _stack[_sp+1] = _stack[_sp-1];
+            _sp += 2;
+            break;
+        case OpCode::loada:
+            _stack[_sp++] = frameAddress(_wideOperands[ins.x].first, _wideOperands[ins.x].second);
+            break;
+        default:
+            executeInstruction(ins);
+            break;
+        }
+        ++_ip;
+        ++_counterInstruction;
+    }
+}
+
+// the usual loop, telling the profiler each instruction before it executes
+// and each call and return as the frames change
+void VM::runProfiledCode() {
+    if (!_profiler->started()) {
+        for (auto& context : _contexts) {
+            _profiler->enter(context.functionIndex, codeOf(context.functionIndex).code.size());
+        }
     }
+    while (static_cast<std::size_t>(_ip) < _codeSize) {
+        auto depth = _contexts.size();
+        _profiler->count(_functionIndex, _ip);
+        executeInstruction(_code[_ip]);
+        if (_contexts.size() > depth) {
+            // not _codeSize, a call may suspend the run
+            _profiler->enter(_functionIndex, codeOf(_functionIndex).code.size());
+        }
+        else if (_contexts.size() < depth) {
+            _profiler->leave();
+        }
+        ++_ip;
+        ++_counterInstruction;
+    }
+}
+
+// the run loop stops after the current instruction as it finds no code left,
+// proceed() puts the size back
+void VM::suspend() {
+    _suspendedCodeSize = _codeSize;
+    _codeSize = 0;
+    _suspended = true;
 }
 
 void VM::printStackTrace(std::ostream& out) {
@@ -123,11 +612,11 @@ void VM::printStackTrace(std::ostream& out) {
         return;
     }
     auto pc = this->_ip;
-    if (pc >= _currentInstructions.size()) {
+    if (static_cast<std::size_t>(pc) >= _codeSize) {
         println(out, "          control reaches the end of function", rit->functionName, "without return");
     }
     else {
-        println(out, "          function", rit->functionName, "at instruction", pc, ":", _currentInstructions.at(pc));
+        println(out, "          function", rit->functionName, "at instruction", pc, ":", _program->source(_functionIndex).at(pc));
     }
     while (true) {
         pc = rit->prevPC;
@@ -136,16 +625,24 @@ void VM::printStackTrace(std::ostream& out) {
             return;
         }
         if (rit->functionIndex == -1) {
-            println(out, "called by .start at instruction", pc, ":", _file.start.at(pc));
+            println(out, "called by .start at instruction", pc, ":", _program->source(-1).at(pc));
             return;
         }
-        println(out, "called by function", rit->functionName, "at instruction", pc, ":", _file.functions.at(rit->functionIndex).instructions.at(pc));
+        println(out, "called by function", rit->functionName, "at instruction", pc, ":", _program->source(rit->functionIndex).at(pc));
     }
 }
 
+void VM::printLoadStats(std::ostream& out) {
+    println(out, "decoded", _program->decodedCount(), "of", _program->functions().size(), "functions");
+}
+
 void VM::ensureStackRest(addr_t count) {
-    if (_sp + count > MAX_STACK_ADDR) {
-        throw StackOverflow();
+    // the high-water mark never passes MAX_STACK_ADDR, one comparison covers both
+    if (_sp + count > _stackHighWater) {
+        if (_sp + count > MAX_STACK_ADDR) {
+            throw StackOverflow();
+        }
+        _stackHighWater = _sp + count;
     }
 }
 
@@ -163,6 +660,9 @@ slot_t* VM::toHeapPtr(addr_t addr) {
 }
 
 slot_t* VM::checkAddr(addr_t addr, addr_t count) {
+    if (_locality != nullptr) {
+        observeAccess(addr);
+    }
     addr_t end = addr + count;
     if (MIN_STACK_ADDR <= addr && addr < this->_sp) {
         if (end > this->_sp) {
@@ -181,6 +681,20 @@ slot_t* VM::checkAddr(addr_t addr, addr_t count) {
     throw InvalidMemoryAccess("tried to access unexistent memory");
 }
 
+void VM::observeAccess(addr_t addr) const {
+    if (MIN_STACK_ADDR <= addr && addr < _sp) {
+        _locality->stack(addr, addr >= _bp);
+        return;
+    }
+    // the blocks are allocated in the order of their addresses
+    auto block = std::upper_bound(_heapRecord.begin(), _heapRecord.end(), addr, [](addr_t a, auto& p) {
+        return a < p.first;
+    });
+    if (block != _heapRecord.begin() && addr < std::prev(block)->first + std::prev(block)->second) {
+        --block;
+        _locality->heap(addr, block - _heapRecord.begin(), block->first, block->second);
+    }
+}
 
 void VM::DEC_SP(addr_t count) {
     ensureStackUsed(count);
@@ -201,10 +715,22 @@ addr_t VM::NEW(addr_t count) {
     if (st + count >= MAX_HEAP_ADDR) {
         throw HeapOverflow();
     }
+    if (_limits.heapSlots != 0 && st + count - MIN_HEAP_ADDR > _limits.heapSlots) {
+        throw LimitExceeded("heap limit exceeded");
+    }
     _heapRecord.emplace_back(st, count);
+    _heapHighWater = std::max(_heapHighWater, st + count);
     return st;
 }
 
+inline addr_t VM::frameAddress(u2 level_diff, addr_t offset) {
+    int staticLink = _contexts.size()-1;
+    for (int ld = level_diff; ld > 0; --ld) {
+        staticLink = _contexts.at(staticLink).staticLink;
+    }
+    return _contexts.at(staticLink).BP + offset;
+}
+
 void VM::DUP() {
     ensureStackUsed(1);
     ensureStackRest(1);
@@ -292,20 +818,35 @@ void VM::WRITE<double_t>(addr_t addr, double_t value) {
 }
 
 void VM::JUMP(u2 offset) {
-    if (0 > offset || offset >= _currentInstructions.size()) {
+    if (0 > offset || offset >= _codeSize) {
         throw InvalidControlTransfer();
     }
+    // every loop passes a jump, so the budget and a cooperative run are looked after here,
+    // before _ip moves, for the stack trace
+    if (_counterInstruction >= _checkAt && checkBudget()) {
+        suspend();
+    }
     this->_ip = offset - 1;
+    // and a signalled checkpoint is taken soon
+    if (_checkpointSignal && armTrap(_functionIndex, offset)) {
+        _checkpointSignal = 0;
+    }
 }
 
 void VM::CALL(u2 index) {
-    if (0 > index || index >= this->_file.functions.size()) {
+    auto& functions = _program->functions();
+    if (0 > index || index >= functions.size()) {
         throw InvalidControlTransfer();
     }
-    Function& calledFunction = this->_file.functions.at(index);
+    if (_limits.callDepth != 0 && _contexts.size() > _limits.callDepth) {
+        throw LimitExceeded("call depth limit exceeded");
+    }
+    // as does every recursion a call
+    bool yield = _counterInstruction >= _checkAt && checkBudget();
+    auto& calledFunction = functions[index];
     Context newContext;
     newContext.functionIndex = index;
-    newContext.functionName = std::get<str_t>(this->_file.constants.at(calledFunction.nameIndex).value);
+    newContext.functionName = std::get<str_t>(_program->constants().at(calledFunction.nameIndex).value);
 
     newContext.functionLevel = calledFunction.level;
     int newLv = newContext.functionLevel;
@@ -329,26 +870,72 @@ void VM::CALL(u2 index) {
     this->_bp = this->_sp - calledFunction.paramSize;
     newContext.prevSP = this->_bp;
     newContext.BP = this->_bp;
-    _contexts.push_back(newContext);
+    pushContext(std::move(newContext));
     this->_ip = -1;
-    this->_currentInstructions = calledFunction.instructions;
+    enterCode(index);
+    if (_tracer != nullptr) {
+        _tracer->call(index);
+    }
+    if (_checkpointSignal && armTrap(index, 0)) {
+        _checkpointSignal = 0;
+    }
+    // after enterCode, which sets the code size suspend() takes away
+    if (yield) {
+        suspend();
+    }
+}
+
+// a push within the capacity writes the new frame before the size grows,
+// only a reallocation leaves the frames unreadable for a while
+void VM::pushContext(Context&& context) {
+    if (_contexts.size() < _contexts.capacity()) {
+        _contexts.push_back(std::move(context));
+        return;
+    }
+    _framesMoving = 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    _contexts.push_back(std::move(context));
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    _framesMoving = 0;
+}
+
+std::size_t VM::sampleFrames(int* functions, std::size_t max) const noexcept {
+    if (_framesMoving) {
+        return 0;
+    }
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    auto frames = _contexts.data();
+    auto depth = _contexts.size();
+    auto first = depth > max ? depth - max : 0;
+    for (auto i = first; i < depth; ++i) {
+        functions[i - first] = frames[i].functionIndex;
+    }
+    return depth;
+}
+
+// the functions of the frames and where each was called from
+u8 VM::stackHash() const {
+    u8 h = 0xcbf29ce484222325ull;
+    for (auto& context : _contexts) {
+        std::pair<int, addr_t> frame(context.functionIndex, context.prevPC);
+        h = hash_bytes(&frame, sizeof frame, h);
+    }
+    return h;
 }
 
 void VM::RET() {
     if (_contexts.size() <= 1) {
         throw InvalidControlTransfer();
     }
+    if (_tracer != nullptr) {
+        _tracer->ret();
+    }
     Context curContext = _contexts.back();
     this->_sp = curContext.prevSP;
     this->_bp = curContext.prevBP;
     this->_ip = curContext.prevPC;
     _contexts.pop_back();
-    if (_contexts.size() != 1) {
-        this->_currentInstructions = _file.functions.at(_contexts.back().functionIndex).instructions;
-    }
-    else {
-        this->_currentInstructions = _file.start;
-    }
+    enterCode(_contexts.back().functionIndex);
 }
 
 void VM::ipush(int_t value) {
@@ -368,13 +955,14 @@ void VM::dup2() {
 }
 
 void VM::loadc(u2 index) {
-    if (index < 0 || index >= _file.constants.size()) {
+    auto& constants = _program->constants();
+    if (index < 0 || index >= constants.size()) {
         throw;
     }
-    auto& constant = _file.constants.at(index);
+    auto& constant = constants[index];
     switch (constant.type)
     {
-    case Constant::Type::STRING: PUSH(_stringLiteralPool.at(index)); break;
+    case Constant::Type::STRING: PUSH(MIN_HEAP_ADDR + _program->stringOffset(index)); break;
     case Constant::Type::INT:    PUSH(std::get<int_t>(constant.value));    break;
     case Constant::Type::DOUBLE: PUSH(std::get<double_t>(constant.value)); break;
     default: throw; break;
@@ -382,16 +970,26 @@ void VM::loadc(u2 index) {
 }
 
 void VM::loada(u2 level_diff, addr_t offset) {
-    int staticLink = _contexts.size()-1;
-    for (int ld = level_diff; ld > 0; --ld) {
-        staticLink = _contexts.at(staticLink).staticLink;
-    }
-    addr_t bp = _contexts.at(staticLink).BP;
-    PUSH<addr_t>(bp+offset);
+    PUSH<addr_t>(frameAddress(level_diff, offset));
 }
 
 void VM::_new() {
-    PUSH(NEW(POP<int_t>()));
+    auto count = POP<int_t>();
+    if (_heapProfiler == nullptr) {
+        PUSH(NEW(count));
+        return;
+    }
+    HeapProfiler::Site site(_functionIndex, _ip);
+    addr_t addr;
+    try {
+        addr = NEW(count);
+    }
+    catch (const std::exception&) {
+        _heapProfiler->failed(site, count);
+        throw;
+    }
+    _heapProfiler->allocated(site, count, stackHash(), addr + count - MIN_HEAP_ADDR);
+    PUSH(addr);
 }
 
 void VM::snew(addr_t count) {
@@ -567,10 +1165,26 @@ template <typename T>
 void VM::Tprint() {
     auto value = POP<T>();
     if constexpr (std::is_floating_point_v<T>) {
-        std::cout << std::fixed << std::setprecision(6) << value;
+        // what std::fixed with precision 6 prints
+        char buffer[512];
+        int n = std::snprintf(buffer, sizeof buffer, "%.6f", value);
+        _outBuffer.append(buffer, n);
+    }
+    else if constexpr (std::is_same_v<T, char_t>) {
+        _outBuffer.push_back(static_cast<char>(value));
+    }
+    else {
+        char buffer[16];
+        auto res = std::to_chars(buffer, buffer + sizeof buffer, value);
+        _outBuffer.append(buffer, res.ptr);
+    }
+    if (_tracer != nullptr) {
+        constexpr auto op = std::is_floating_point_v<T> ? OpCode::dprint
+            : std::is_same_v<T, char_t> ? OpCode::cprint : OpCode::iprint;
+        _tracer->instant(op, _functionIndex);
     }
-    else if constexpr (std::is_integral_v<T>) {
-        std::cout << value;
+    if (_outBuffer.size() >= OUTPUT_BATCH_SIZE) {
+        handOverOutput();
     }
 }
 
@@ -579,25 +1193,65 @@ void VM::sprint() {
     // std::cout << reinterpret_cast<const char*>(str);
     char_t ch;
     while ((ch = READ<char_t>(str++)) != '\0') {
-        std::cout << ch;
+        _outBuffer.push_back(static_cast<char>(ch));
+    }
+    if (_tracer != nullptr) {
+        _tracer->instant(OpCode::sprint, _functionIndex);
+    }
+    if (_outBuffer.size() >= OUTPUT_BATCH_SIZE) {
+        handOverOutput();
     }
 }
 
 void VM::printl() {
-    std::cout << std::endl;
+    _outBuffer.push_back('\n');
+    if (_tracer != nullptr) {
+        _tracer->instant(OpCode::printl, _functionIndex);
+    }
+    handOverOutput();
+}
+
+void VM::handOverOutput() {
+    if (_output != nullptr && !_outBuffer.empty()) {
+        _output->write(_outBuffer.data(), _outBuffer.size());
+    }
+    _outBuffer.clear();
+}
+
+void VM::flushOutput() {
+    handOverOutput();
+    if (_output != nullptr) {
+        _output->flush();
+    }
 }
 
 template <typename T>
 void VM::Tscan() {
-    if (T value; std::cin >> value) {
-        PUSH(value);
+    // a cooperative run does not wait for input, the scan is executed again when it proceeds
+    if (_cooperative && !_scanner.ready()) {
+        --_ip;
+        --_counterInstruction;
+        _waitingForInput = true;
+        suspend();
+        return;
     }
-    else {
+    std::chrono::steady_clock::time_point began;
+    if (_tracer != nullptr) {
+        began = std::chrono::steady_clock::now();
+    }
+    T value;
+    if (!_scanner.scan(value)) {
         throw IOError();
     }
+    if (_tracer != nullptr) {
+        constexpr auto op = std::is_floating_point_v<T> ? OpCode::dscan
+            : std::is_same_v<T, char_t> ? OpCode::cscan : OpCode::iscan;
+        _tracer->scan(op, _functionIndex, began);
+    }
+    PUSH(value);
 }
 
-void VM::executeInstruction(const Instruction& ins) {
+void VM::executeInstruction(const PackedInstruction& ins) {
     //println(std::cout, "execute", ins);
     switch (ins.op)
     {
@@ -610,7 +1264,7 @@ void VM::executeInstruction(const Instruction& ins) {
     case OpCode::dup:     dup();        break;
     case OpCode::dup2:    dup2();       break;
     case OpCode::loadc:   loadc(ins.x); break;
-    case OpCode::loada:   loada(ins.x, ins.y);break;
+    case OpCode::loada:   loada(_wideOperands[ins.x].first, _wideOperands[ins.x].second); break;
     case OpCode::_new:    _new();       break;
     case OpCode::snew:    snew(ins.x);  break;
     
@@ -668,6 +1322,7 @@ void VM::executeInstruction(const Instruction& ins) {
     case OpCode::iscan:   Tscan<int_t>();     break;
     case OpCode::dscan:   Tscan<double_t>();  break;
     case OpCode::cscan:   Tscan<char_t>();    break;
+    case OpCode::_trap:   fireTrap();         break;
     default:
         break;
     }
@@ -6,16 +6,41 @@
 #include "./constant.h"
 #include "./function.h"
 #include "./file.h"
+#include "./program.h"
+#include "./io.h"
 
 #include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
 #include <cstdint>
 #include <string>
 #include <vector>
 #include <variant>
+#include <optional>
+#include <csignal>
 
 namespace vm {
 
+class Profiler;
+class Tracer;
+class HeapProfiler;
+class LocalityProfiler;
+
 class VM {
+public:
+    enum class Status { finished, yielded, waitingForInput };
+
+    // a run exceeding any of them stops with a runtime error, 0 means no limit.
+    // instructions and seconds are looked at in jumps and calls only,
+    // heapSlots counts the string literals too
+    struct Limits {
+        u8 instructions = 0;
+        double seconds = 0;
+        std::size_t callDepth = 0;
+        addr_t heapSlots = 0;
+    };
+
 private:
     static const addr_t MIN_STACK_ADDR;
     static const addr_t MAX_STACK_ADDR;
@@ -23,18 +48,38 @@ private:
     static const addr_t MIN_HEAP_ADDR;
     static const addr_t MAX_HEAP_ADDR;
     static const addr_t MAX_HEAP_SIZE;
+    static const std::size_t OUTPUT_BATCH_SIZE;
+    static const u8 CLOCK_CHECK_INTERVAL;
+    static const u8 BAKE_INSTRUCTION_LIMIT;
 
 private:
     bool prepared;
-    File _file;
+    std::shared_ptr<const Program> _program;
     //std::vector<std::shared_ptr<Stack>> stacks;
-    std::unique_ptr<slot_t[]> _stack;
-    std::unique_ptr<slot_t[]> _heap;
+    // calloc'ed, so pages the program never touches are never faulted in.
+    // the stack is mmap'ed instead when it has a guard page
+    struct FreeSlots {
+        FreeSlots() noexcept : mapping(nullptr), mappedSize(0) {}
+        FreeSlots(void* mapping, std::size_t mappedSize) noexcept : mapping(mapping), mappedSize(mappedSize) {}
+        void operator()(slot_t* p) const;
+        void* mapping;
+        std::size_t mappedSize;
+    };
+    std::unique_ptr<slot_t[], FreeSlots> _stack;
+    std::unique_ptr<slot_t[], FreeSlots> _heap;
     std::vector<std::pair<addr_t, addr_t>> _heapRecord;
+    // the stack above it has never been written since the last reset,
+    // pinned at MAX_STACK_ADDR with the guard page
+    addr_t _stackHighWater;
+    // the heap above it has never been written since the last reset,
+    // the record can end below it when a run starts over or a snapshot is restored
+    addr_t _heapHighWater;
+    // a push past the end faults in the guard page instead of being checked
+    bool _guardedStack;
     addr_t _sp;
     addr_t _bp;
     addr_t _ip;
-    int _counterInstruction;
+    u8 _counterInstruction;
     // int _counterMicroIns;
     
     struct Context {
@@ -48,33 +93,162 @@ private:
         vm::u2 functionLevel;
     };
     std::vector<Context> _contexts;
-    std::vector<Instruction> _currentInstructions;
-    std::unordered_map<vm::u2, addr_t> _stringLiteralPool;
+    // set while _contexts is reallocated, a sampler must not read it then
+    volatile std::sig_atomic_t _framesMoving;
+    // the code in use, [0] for .start and [i+1] for function i, fetched from the program on first use.
+    // a trap is planted in a private copy, the program is never written
+    std::vector<const Program::Code*> _codeOf;
+    std::vector<std::unique_ptr<Program::Code>> _privateCode;
+    const PackedInstruction* _code;
+    const std::pair<u2, addr_t>* _wideOperands;
+    std::size_t _codeSize;
+    int _functionIndex;
+    Output* _output;
+    InputScanner _scanner;
+    // formatted output not handed to _output yet
+    std::string _outBuffer;
+    std::unique_ptr<Output> _ownedOutput;
+    std::unique_ptr<Input> _ownedInput;
+    std::ostream* _err;
+    // what stopped the last run, empty if it ran to the end
+    std::string _error;
+    Limits _limits;
+    std::chrono::steady_clock::time_point _deadline;
+    bool _limitExceeded;
+    Profiler* _profiler;
+    Tracer* _tracer;
+    HeapProfiler* _heapProfiler;
+    LocalityProfiler* _locality;
+
+    struct Trap {
+        int functionIndex;
+        addr_t ip;
+        OpCode op;  // the instruction replaced by the trap
+    };
+    std::vector<Trap> _traps;
+    std::string _checkpointPath;
+    std::optional<std::pair<int, addr_t>> _checkpointMark;
+    static volatile std::sig_atomic_t _checkpointSignal;
+
+    // a cooperative run stops at the first jump or call at or after _yieldAt,
+    // and before a scan whose input is not there yet
+    bool _cooperative;
+    u8 _yieldAt;
+    // jumps and calls look at the limits and _yieldAt only from this instruction count on
+    u8 _checkAt;
+    bool _suspended;
+    bool _waitingForInput;
+    std::size_t _suspendedCodeSize;
     
 public:
-    VM(File) noexcept;
+    explicit VM(std::shared_ptr<const Program> program) noexcept;
     VM(const VM&) = delete;
     VM(VM&&) = delete;
     VM& operator=(VM) = delete;
 
 public:
-    static std::unique_ptr<VM> make_vm(File file);
+    static std::unique_ptr<VM> make_vm(std::shared_ptr<const Program> program, std::ostream& out = std::cout,
+                                       std::istream& in = std::cin, std::ostream& err = std::cerr);
+    // out and in must outlive the VM
+    static std::unique_ptr<VM> make_vm(std::shared_ptr<const Program> program, Output& out, Input& in,
+                                       std::ostream& err = std::cerr);
+    // the program of the next runs
+    void load(std::shared_ptr<const Program> program);
+    // run from the beginning, again if the VM has run before
     void start();
+    // a run in steps, for a scheduler or a fork server:
+    // begin() sets it up like start() without executing anything,
+    // proceed() executes about quantum instructions (0 for no limit), counted at jumps and calls,
+    // or until a scan would wait for input, and can be called again unless the run finished.
+    // a failed run is finished with error() set
+    void begin();
+    Status proceed(u8 quantum);
+    // the time limit of a begun run counts from now instead of from begin(),
+    // for a run prepared ahead of time like in the parent of a fork server
+    void restartBudget() { startBudget(); }
+    // back to the state of a new VM, only the memory the last run touched is cleared
+    // and the packed code and string literals are kept
+    void reset() noexcept;
+    // the backends of the next runs, they must outlive the VM or the next attach
+    void attach(Output& out, Input& in, std::ostream& err = std::cerr);
+    // continue a run saved by a checkpoint
+    void resume(const std::string& snapshotPath);
+    void printLoadStats(std::ostream&);
+    // dump the state to path before executing instruction ip of the function
+    // (-1 for .start), and whenever SIGUSR1 arrives if enableCheckpointSignal() was called
+    void setCheckpoint(std::string path, std::optional<std::pair<int, addr_t>> mark);
+    static void enableCheckpointSignal();
+    // run .start of file ahead of time and keep the globals it leaves as the data section,
+    // throws when .start or a function it calls does I/O or runs past BAKE_INSTRUCTION_LIMIT instructions
+    static void bakeStart(File& file);
+    u8 executedInstructions() const { return _counterInstruction; }
+    const std::string& error() const { return _error; }
+    // for the next runs
+    void setLimits(const Limits& limits) { _limits = limits; }
+    // maps the stack again with a PROT_NONE page past its end, a push into it is a stack overflow
+    // caught by a SIGSEGV handler, so the pushes of the run loop compare nothing.
+    // the memory of the last run is dropped
+    void useGuardPage();
+    // counts every instruction and call of the next runs into profiler, nullptr to stop.
+    // it must outlive the runs
+    void setProfiler(Profiler* profiler) { _profiler = profiler; }
+    // records the calls, returns and I/O of the next runs into tracer, nullptr to stop.
+    // it must outlive the runs
+    void setTracer(Tracer* tracer) { _tracer = tracer; }
+    // reports every new of the next runs to profiler, nullptr to stop. it must outlive the runs
+    void setHeapProfiler(HeapProfiler* profiler) { _heapProfiler = profiler; }
+    // reports every stack and heap access of the next runs to profiler, nullptr to stop.
+    // it must outlive the runs
+    void setLocalityProfiler(LocalityProfiler* profiler) { _locality = profiler; }
+    // the last run stopped at one of the limits
+    bool limitExceeded() const { return _limitExceeded; }
+    // the heap slots the last run allocated, the string literals included
+    addr_t heapUsed() const;
+    // for a signal handler interrupting the thread of the run: copies the function of each frame,
+    // from the outermost, or of the innermost max of them, and returns the depth.
+    // 0 when the frames are being moved
+    std::size_t sampleFrames(int* functions, std::size_t max) const noexcept;
 
 private: 
     void init() noexcept;
+    void allocateMemory();
     void buildStringLiteralPool();
+    void loadData(const DataSection& data);
+    void enterProgram();
+    void enterStart();
     void run();
+    void suspend();
+    void startBudget();
+    void scheduleCheck();
+    bool checkBudget();
+    void runCode();
+    void runGuardedCode();
+    void runProfiledCode();
+    void handOverOutput();
+    void flushOutput();
     void ensureStackRest(addr_t count);
     void ensureStackUsed(addr_t count);
     slot_t* checkAddr(addr_t addr, addr_t count);
+    // reports addr to the locality profiler before checkAddr checks it
+    void observeAccess(addr_t addr) const;
     slot_t* toHeapPtr(addr_t);
     slot_t* toStackPtr(addr_t);
     void printStackTrace(std::ostream&);
+    void prepareCode();
+    const Program::Code& codeOf(int functionIndex);
+    Program::Code& privateCode(int functionIndex);
+    void enterCode(int functionIndex);
+    void pushContext(Context&& context);
+    u8 stackHash() const;
+    bool armTrap(int functionIndex, addr_t ip);
+    void fireTrap();
+    void saveSnapshot(const std::string& path);
+    void loadSnapshot(const std::string& path);
 
     void    DEC_SP(addr_t count);
     void    INC_SP(addr_t count);
     addr_t  NEW(addr_t count);
+    addr_t  frameAddress(u2 level_diff, addr_t offset);
     void    DUP();
     void    DUP2();
     template<typename T>
@@ -91,7 +265,7 @@ private:
     void    RET();
 
 private:
-    void executeInstruction(const Instruction&);
+    void executeInstruction(const PackedInstruction&);
 
     void ipush(int_t value);
     void popn(addr_t count);
@@ -0,0 +1,139 @@
+#include "./writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+namespace vm {
+
+AsyncWriter::AsyncWriter(int fd, std::size_t bufferSize)
+    : _fd(fd), _front(bufferSize), _back(bufferSize), _backSize(0),
+      _pending(false), _stop(false), _failed(false) {
+    setp(_front.data(), _front.data() + _front.size());
+    _thread = std::thread(&AsyncWriter::loop, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    drain();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+}
+
+bool AsyncWriter::handoff(bool wait) {
+    std::size_t size = pptr() - pbase();
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!wait && _pending) {
+        // the fd is still busy, keep filling the current buffer,
+        // it is handed over by the next flush or when it is full
+        return !_failed;
+    }
+    _cv.wait(lock, [this] { return !_pending; });
+    if (size != 0) {
+        _front.swap(_back);
+        _backSize = size;
+        _pending = true;
+        setp(_front.data(), _front.data() + _front.size());
+        lock.unlock();
+        _cv.notify_all();
+    }
+    return !_failed;
+}
+
+bool AsyncWriter::handOver() {
+    return handoff(true);
+}
+
+bool AsyncWriter::drain() {
+    handoff(true);
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return !_pending; });
+    return !_failed;
+}
+
+void AsyncWriter::loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _cv.wait(lock, [this] { return _pending || _stop; });
+        if (!_pending) {
+            return;
+        }
+        const char* p = _back.data();
+        std::size_t rest = _backSize;
+        lock.unlock();
+        bool failed = false;
+        while (rest > 0) {
+            auto n = ::write(_fd, p, rest);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                break;
+            }
+            p += n;
+            rest -= n;
+        }
+        lock.lock();
+        _failed = _failed || failed;
+        _pending = false;
+        _cv.notify_all();
+    }
+}
+
+AsyncWriter::int_type AsyncWriter::overflow(int_type ch) {
+    if (!handoff(true)) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize AsyncWriter::xsputn(const char* s, std::streamsize count) {
+    std::streamsize written = 0;
+    while (written < count) {
+        std::streamsize room = epptr() - pptr();
+        if (room == 0) {
+            if (!handoff(true)) {
+                break;
+            }
+            continue;
+        }
+        std::streamsize n = std::min(room, count - written);
+        std::memcpy(pptr(), s + written, n);
+        pbump(static_cast<int>(n));
+        written += n;
+    }
+    return written;
+}
+
+int AsyncWriter::sync() {
+    return handoff(false) ? 0 : -1;
+}
+
+void drain_output(std::ostream& out) {
+    if (auto writer = dynamic_cast<AsyncWriter*>(out.rdbuf()); writer != nullptr) {
+        writer->drain();
+    }
+    else {
+        out.flush();
+    }
+}
+
+void hand_over_output(std::ostream& out) {
+    if (auto writer = dynamic_cast<AsyncWriter*>(out.rdbuf()); writer != nullptr) {
+        writer->handOver();
+    }
+    else {
+        out.flush();
+    }
+}
+
+}
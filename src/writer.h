@@ -0,0 +1,61 @@
+#ifndef WRITER_H_INCLUDED
+#define WRITER_H_INCLUDED
+
+#include <streambuf>
+#include <ostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace vm {
+
+// double-buffered output: the owner fills one buffer while a background
+// thread drains the other to the fd.
+// flushing (std::endl, std::flush) only hands the buffer over when the fd is
+// idle, use drain() to wait until everything written so far has reached the fd.
+class AsyncWriter : public std::streambuf {
+public:
+    explicit AsyncWriter(int fd, std::size_t bufferSize = 1 << 16);
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+    virtual ~AsyncWriter();
+
+    // hand the filled buffer over, waiting for the fd only if it still writes the other one
+    bool handOver();
+    // hand the filled buffer over and wait until both buffers are empty
+    bool drain();
+
+protected:
+    virtual int_type overflow(int_type ch) override;
+    virtual std::streamsize xsputn(const char* s, std::streamsize count) override;
+    virtual int sync() override;
+
+private:
+    bool handoff(bool wait);
+    void loop();
+
+private:
+    int _fd;
+    std::vector<char> _front;
+    std::vector<char> _back;
+    std::size_t _backSize;
+    bool _pending;
+    bool _stop;
+    bool _failed;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
+};
+
+// flush the stream, and for an AsyncWriter also wait for the fd writes,
+// so that anything printed to another stream afterwards comes out later
+void drain_output(std::ostream& out);
+
+// flush the stream, and for an AsyncWriter hand the buffer over
+// even when the fd is busy, but without waiting for it to be written
+void hand_over_output(std::ostream& out);
+
+}
+
+#endif